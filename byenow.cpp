@@ -19,7 +19,16 @@
 #include "libp/_system_api.h"
 #include "libp/time.h"
 
+#include <wctype.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+
 #include "ultra_machine.h"
+#include "fs_sim.h"
+#include "fs_relative.h"
+#include "tree_gen.h"
+#include "snapshot.h"
+#include "self_check.h"
 #include "delete_file.h"
 #include "utils.h"
 
@@ -35,19 +44,35 @@
                 "  -1 --one-liner         show progress as a single line\n" \
                 "  -b --show-bytes        show total/deleted byte counts\n" \
                 "  -e --list-errors       list all errors upon completion\n" \
+                "  -l --latency           show latencies and throughput upon completion\n" \
                 "  -y --yes               don't ask to confirm the deletion\n" \
                 "  -x --yolo              don't block deletion in restricted paths\n" \
                 "\n" \
                 "  -o --omni-delete       allow <folder> to point at a file\n" \
                 "  -k --keep-folder       don't delete the folder itself, just its contents\n" \
                 "\n" \
-                "  -t --threads <count>   use specified number of threads\n" \
+                "  -t --threads <count>   use specified number of threads, or 'auto'\n" \
                 "  -n --delete-ntapi      use NtDeleteFile to remove files\n" \
+                "  -r --retries <count>   retry sharing violations and such, 3 by default\n" \
+                "\n" \
+                "  --save-scan <file>     save the scan, with --preview or --staged\n" \
+                "  --load-scan <file>     delete what a saved scan lists, without scanning\n" \
+                "  --journal <file>       log deleted folders, to resume a --load-scan run\n" \
                 "\n" \
                 "  * By default the thread count is set to the number of CPU cores.\n" \
                 "    For local folders it doesn't make sense to go above that, but\n" \
                 "    for folders on network shares raising the thread count may be\n" \
-                "    a good thing to try, especially for high-latency connections.\n"
+                "    a good thing to try, especially for high-latency connections.\n" \
+                "    With '-t auto' the count is adjusted on the fly to where the\n" \
+                "    throughput stops growing.\n" \
+                "\n" \
+                "  * Scanning and deleting use separate thread pools, which split\n" \
+                "    the thread count between them. To size them individually use\n" \
+                "    --scan-threads and --delete-threads.\n" \
+                "\n" \
+                "  * A run with --load-scan and --journal can be interrupted and then\n" \
+                "    resumed by repeating it with the same scan and journal. The\n" \
+                "    journal is removed once the run completes.\n"
 
 //
 enum EXIT_CODES
@@ -57,6 +82,7 @@ enum EXIT_CODES
 	RC_whoops_seh       = 2,       // see wmain_seh()
 	RC_whoops_cpp       = 3,       // see wmain()
 	RC_unlikely         = 4,
+	RC_check_failed     = 5,       // --self-check
 	RC_ok_with_errors   = 10,      // ... + log10(error_count)
 
 	// init errors
@@ -71,6 +97,12 @@ enum EXIT_CODES
 	RC_path_restricted  = 63,
 	RC_path_cant_expand = 64,
 	RC_path_cant_check  = 65,
+	RC_path_exists      = 66,      // --generate
+
+	// aux file errors
+	RC_generate_failed  = 70,
+	RC_snapshot_failed  = 71,      // --save-scan, --load-scan
+	RC_journal_failed   = 72,
 };
 
 //
@@ -91,6 +123,25 @@ struct context : ultra_mach_cb
 	bool             cryptic;
 	bool             show_bytes;
 	bool             list_errors;
+	bool             show_latency;
+	wstring          trace_file;
+	wstring          scan_out;     // save scan results here
+	wstring          scan_in;      // ... and load them from here
+	wstring          jrnl_file;    // resume from and log to
+
+	bool             relative;     // delete relative to folder handles
+	fs_api_relative  rel;
+
+	bool             simulate;     // run against an in-memory tree
+	fs_sim_profile   sim_profile;
+	size_t           sim_depth;
+	size_t           sim_fanout;
+	size_t           sim_files;
+	size_t           sim_errors;   // per million deletes
+
+	wstring          gen_shape;    // synthetic tree, see tree_gen.h
+	size_t           gen_scale;
+	bool             gen_only;     // create it on disk and exit
 
 	// state
 
@@ -98,6 +149,9 @@ struct context : ultra_mach_cb
 	bool             enough;
 
 	folder           root;
+	tracer           trace;
+	journal          jrnl;
+	fs_sim           sim;
 	dword            path_attrs;
 	bool             is_a_file;
 	api_error_vec    scanner_err;
@@ -120,6 +174,8 @@ struct context : ultra_mach_cb
 	void init();
 	void parse_args(int argc, wchar_t ** argv);
 	void parse_uint(int argc, wchar_t ** argv, size_t & next, size_t & val);
+	void parse_str(int argc, wchar_t ** argv, size_t & next, wstring & val);
+	void parse_shape(int argc, wchar_t ** argv, size_t & next);
 
 	void syntax(int rc);
 	void abort(int rc, const char * format, ...);
@@ -136,9 +192,17 @@ struct context : ultra_mach_cb
 	void check_path();
 	void process();
 	void delete_file();
+	void generate();
+	void save_scan(const folder & root);
+	void load_scan(folder & root);
+	void open_journal();
+	void cancelled();
 
 	void report();
 	void report_errors();
+	void report_latency();
+	void report_latency(const char * label, const latency_hist & h);
+	void report_throughput();
 
 	//
 	static BOOL __stdcall on_console_event_proxy(dword type);
@@ -160,6 +224,18 @@ context::context()
 	cryptic = false;
 	show_bytes = false;
 	list_errors = false;
+	show_latency = false;
+
+	relative = false;
+
+	simulate = false;
+	sim_depth = 4;
+	sim_fanout = 10;
+	sim_files = 100;
+	sim_errors = 0;
+
+	gen_scale = 1;
+	gen_only = false;
 
 	interactive = false;
 	enough = false;
@@ -261,12 +337,43 @@ void context::parse_args(int argc, wchar_t ** argv)
 			continue;
 		}
 
+		if (! wcscmp(arg, L"-l") || ! wcscmp(arg, L"--latency"))
+		{
+			show_latency = true;
+			continue;
+		}
+
 		if (! wcscmp(arg, L"-t") || ! wcscmp(arg, L"--threads"))
 		{
+			if (i+1 < (size_t)argc && ! wcscmp(argv[i+1], L"auto"))
+			{
+				mach_conf.threads_auto = true;
+				i++;
+				continue;
+			}
+
 			parse_uint(argc, argv, i, mach_conf.threads);
 			continue;
 		}
 
+		if (! wcscmp(arg, L"--scan-threads"))
+		{
+			parse_uint(argc, argv, i, mach_conf.scan_threads);
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--delete-threads"))
+		{
+			parse_uint(argc, argv, i, mach_conf.delete_threads);
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--threads-max"))
+		{
+			parse_uint(argc, argv, i, mach_conf.threads_max);
+			continue;
+		}
+
 		if (! wcscmp(arg, L"--scan-buf-kb"))
 		{
 			parse_uint(argc, argv, i, mach_conf.scanner_buf_size);
@@ -284,9 +391,138 @@ void context::parse_args(int argc, wchar_t ** argv)
 			continue;
 		}
 
+		if (! wcscmp(arg, L"-r") || ! wcscmp(arg, L"--retries"))
+		{
+			parse_uint(argc, argv, i, mach_conf.retries);
+
+			if (mach_conf.retries > 16)
+				abort(RC_invalid_arg, "Maximum supported retry count is 16.");
+
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--retry-delay"))
+		{
+			parse_uint(argc, argv, i, mach_conf.retry_msecs);
+
+			if (mach_conf.retry_msecs > 60*1000)
+				abort(RC_invalid_arg, "Maximum supported retry delay is 60 seconds.");
+
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--delete-relative"))
+		{
+			relative = true;
+			continue;
+		}
+
 		if (! wcscmp(arg, L"--delete-batch"))
 		{
 			parse_uint(argc, argv, i, mach_conf.deleter_batch);
+			mach_conf.deleter_batch_auto = false;
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--delete-window"))
+		{
+			parse_uint(argc, argv, i, mach_conf.deleter_window);
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--scan-chunk"))
+		{
+			parse_uint(argc, argv, i, mach_conf.scanner_chunk);
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--stream"))
+		{
+			mach_conf.streaming = true;
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--depth-first"))
+		{
+			mach_conf.depth_first = true;
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--save-scan"))
+		{
+			parse_str(argc, argv, i, scan_out);
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--load-scan"))
+		{
+			parse_str(argc, argv, i, scan_in);
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--journal"))
+		{
+			parse_str(argc, argv, i, jrnl_file);
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--trace"))
+		{
+			parse_str(argc, argv, i, trace_file);
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--simulate"))
+		{
+			wstring name;
+
+			parse_str(argc, argv, i, name);
+
+			if (! get_fs_sim_profile(name, sim_profile))
+				abort(RC_invalid_arg, "Unknown simulation profile - %s\n", to_utf8(name).c_str());
+
+			simulate = true;
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--sim-tree"))
+		{
+			if (i+1 < (size_t)argc && ! iswdigit(argv[i+1][0]))
+			{
+				parse_shape(argc, argv, i);
+				continue;
+			}
+
+			if (++i == argc)
+				syntax(RC_invalid_arg);
+
+			if (swscanf(argv[i], L"%zu,%zu,%zu", &sim_depth, &sim_fanout, &sim_files) != 3)
+				syntax(RC_invalid_arg);
+
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--generate"))
+		{
+			parse_shape(argc, argv, i);
+			gen_only = true;
+			continue;
+		}
+
+		if (! wcscmp(arg, L"--self-check"))
+		{
+			string only;
+
+			// optionally followed by the name of the check
+			if (i+1 < (size_t)argc && argv[i+1][0] != L'-')
+				only = to_utf8(argv[++i]);
+
+			exit( run_self_checks(only) ? RC_ok : RC_check_failed );
+		}
+
+		if (! wcscmp(arg, L"--sim-errors"))
+		{
+			parse_uint(argc, argv, i, sim_errors);
 			continue;
 		}
 
@@ -316,6 +552,33 @@ void context::parse_args(int argc, wchar_t ** argv)
 	//
 	path_utf8 = to_utf8(path);
 
+	if (simulate)
+		gen_only = false; // --generate is --sim-tree then
+
+	if (scan_out.size() && ! preview && ! staged)
+		abort(RC_invalid_arg, "Saving the scan requires either --preview or --staged.\n");
+
+	if (scan_out.size() && scan_in.size())
+		abort(RC_invalid_arg, "Can't both save and load the scan.\n");
+
+	if (jrnl_file.size() && preview)
+		abort(RC_invalid_arg, "Journal is for deleting, not previewing.\n");
+
+	if (jrnl_file.size() && scan_in.empty())
+		abort(RC_invalid_arg, "Journal can only resume a run that uses --load-scan.\n");
+
+	// per-file sizes are needed only for these
+	mach_conf.file_bytes = show_bytes || scan_out.size();
+
+	//
+	if (trace_file.size())
+	{
+		if (! trace.init(trace_file))
+			abort(RC_invalid_arg, "Can't create trace file - %s\n", to_utf8(trace_file).c_str());
+
+		mach_conf.trace = &trace;
+	}
+
 	//
 	if (_wcsnicmp(path.c_str(), L"C:\\Windows", 10) == 0 ||
 	    _wcsnicmp(path.c_str(), L"C:\\Users", 8) == 0)
@@ -334,6 +597,34 @@ void context::parse_uint(int argc, wchar_t ** argv, size_t & i, size_t & val)
 		syntax(RC_invalid_arg);
 }
 
+void context::parse_str(int argc, wchar_t ** argv, size_t & i, wstring & val)
+{
+	if (++i == argc)
+		syntax(RC_invalid_arg);
+
+	val = argv[i];
+}
+
+void context::parse_shape(int argc, wchar_t ** argv, size_t & i)
+{
+	size_t pos;
+
+	parse_str(argc, argv, i, gen_shape);
+
+	// <shape>[,<scale>]
+	pos = gen_shape.find(L',');
+	if (pos != -1)
+	{
+		if (! swscanf(gen_shape.c_str() + pos + 1, L"%zu", &gen_scale) || ! gen_scale)
+			syntax(RC_invalid_arg);
+
+		gen_shape.resize(pos);
+	}
+
+	if (! is_tree_shape(gen_shape))
+		abort(RC_invalid_arg, "Unknown tree shape - %s\n", to_utf8(gen_shape).c_str());
+}
+
 //
 void context::syntax(int rc)
 {
@@ -357,7 +648,7 @@ void context::confirm_it()
 	static const char * yes[] = { "y", "yes", "yep", "yup" };
 	char line[32];
 
-	if (preview || ! confirm)
+	if (preview || ! confirm || simulate || gen_only)
 		return;
 
 	if (! is_a_file) printf("Remove [%s] and all its contents? ", path_utf8.c_str());
@@ -419,7 +710,19 @@ bool context::on_ultra_mach_tick(const ultra_mach_info & _info)
 	{
 		info.f_deleted = _info.f_deleted;
 		info.d_deleted = _info.d_deleted;
+		info.delete_threads = _info.delete_threads;
+		info.first_usecs = _info.first_usecs;
+		info.r_queued  = _info.r_queued;
+		info.r_ok      = _info.r_ok;
+		info.r_failed  = _info.r_failed;
 		info.done      = _info.done;
+
+		if (info.done)
+		{
+			info.lat_file   = _info.lat_file;
+			info.lat_folder = _info.lat_folder;
+			info.tail_usecs = _info.tail_usecs;
+		}
 	}
 	else
 	{
@@ -514,6 +817,13 @@ void context::print_verbose_stats(bool scan)
 	else            printf("%s  %10zu  %10zu  %10zu", label, d, f, e);
 
 	if (scan && info.folders_togo) printf("    [%zu to go]", info.folders_togo);
+	if (! scan && info.r_queued)   printf("    [%zu retried]", info.r_queued);
+
+	if (mach_conf.threads_auto)
+	{
+		if (scan && info.scan_threads)     printf("    [%zu threads]", info.scan_threads);
+		if (! scan && info.delete_threads) printf("    [%zu threads]", info.delete_threads);
+	}
 }
 
 void context::print_cryptic_stats()
@@ -532,6 +842,9 @@ void context::print_cryptic_stats()
 			scanner_err.size(), deleter_err.size());
 
 	if (info.folders_togo) printf(" - %zu to go", info.folders_togo);
+	if (info.r_queued)     printf(" - %zu retried", info.r_queued);
+
+	if (mach_conf.threads_auto) printf(" - %zu/%zu threads", info.scan_threads, info.delete_threads);
 }
 
 //
@@ -539,6 +852,13 @@ void context::check_path()
 {
 	wstring full;
 
+	if (simulate)
+	{
+		// it's just a name for the root of the simulated tree
+		path_attrs = FILE_ATTRIBUTE_DIRECTORY;
+		return;
+	}
+
 	if (! get_full_pathname(path, full))
 	{
 		printf("Error: failed to get full path name for [%s].\n", path_utf8.c_str());
@@ -550,6 +870,17 @@ void context::check_path()
 	//
 	path_attrs = elp->GetFileAttributes(path.c_str());
 
+	if (gen_only)
+	{
+		if (path_attrs != -1)
+		{
+			printf("Error: specified path already exists - [%s].\n", path_utf8.c_str());
+			exit(RC_path_exists);
+		}
+
+		return;
+	}
+
 	if (path_attrs == -1)
 	{
 		api_error e;
@@ -580,6 +911,34 @@ void context::process()
 {
 	folder root;
 
+	if (gen_only)
+	{
+		generate();
+		exit(RC_ok);
+	}
+
+	if (relative && ! simulate)
+	{
+		rel.init(path);
+		mach_conf.fs = &rel;
+	}
+
+	if (simulate)
+	{
+		sim_profile.error_ppm = (uint32_t)sim_errors;
+
+		sim.init(path, sim_profile);
+		mach_conf.fs = &sim;
+
+		if (gen_shape.empty())
+			sim.populate(sim_depth, sim_fanout, sim_files);
+		else
+			tree_gen(&sim, gen_scale).generate(path, gen_shape);
+	}
+
+	if (jrnl_file.size())
+		open_journal();
+
 	started = usec();
 	root.self.name = path;
 	root.self.info.attrs = path_attrs;
@@ -591,32 +950,57 @@ void context::process()
 		delete_file();
 	}
 	else
+	if (scan_in.size())
+	{
+		load_scan(root);
+
+		if (! preview)
+		{
+			jrnl.prune(root);
+
+			mode = 0x02;
+			if (! ultra_mach_delete(root, true, mach_conf, this)) // prescanned
+				cancelled();
+
+			if (! jrnl.discard())
+				printf("Warning: failed to remove the journal - [%s]\n", to_utf8(jrnl_file).c_str());
+		}
+	}
+	else
 	if (preview)
 	{
 		mode = 0x01;
 
 		if (! ultra_mach_scan(root, mach_conf, this))
-			exit(enough ? RC_unlikely : RC_cancelled);
+			cancelled();
+
+		if (scan_out.size())
+			save_scan(root);
 	}
 	else
 	if (staged)
 	{
 		mode = 0x01;
 		if (! ultra_mach_scan(root, mach_conf, this))
-			exit(enough ? RC_unlikely : RC_cancelled);
+			cancelled();
+
+		if (scan_out.size())
+			save_scan(root);
 
 		mode = 0x02;
 		if (! ultra_mach_delete(root, true, mach_conf, this)) // prescanned
-			exit(enough ? RC_unlikely : RC_cancelled);
+			cancelled();
 	}
 	else
 	{
 		mode = 0x03;
 		if (! ultra_mach_delete(root, false, mach_conf, this)) // scan & delete
-			exit(enough ? RC_unlikely : RC_cancelled);
+			cancelled();
 	}
 
 	finished = usec();
+
+	jrnl.close();
 }
 
 void context::delete_file()
@@ -656,6 +1040,129 @@ out:
 	on_ultra_mach_tick(temp);
 }
 
+void context::cancelled()
+{
+	jrnl.close(); // don't lose the tail of it
+
+	exit(enough ? RC_unlikely : RC_cancelled);
+}
+
+//
+void context::open_journal()
+{
+	WIN32_FILE_ATTRIBUTE_DATA fa;
+	string tag;
+
+	// the snapshot, as in - which one exactly
+	if (! GetFileAttributesEx(scan_in.c_str(), GetFileExInfoStandard, &fa))
+	{
+		printf("Error: failed to load the scan from [%s]\n", to_utf8(scan_in).c_str());
+		exit(RC_snapshot_failed);
+	}
+
+	tag = stringf("snapshot %I64u %I64u",
+		((uint64_t)fa.nFileSizeHigh << 32) + fa.nFileSizeLow,
+		((uint64_t)fa.ftLastWriteTime.dwHighDateTime << 32) + fa.ftLastWriteTime.dwLowDateTime);
+
+	if (! jrnl.load(jrnl_file, tag))
+	{
+		if (jrnl.stale)
+			printf("Error: the journal is from a different scan - [%s]\n", to_utf8(jrnl_file).c_str());
+		else
+			printf("Error: failed to read the journal - [%s]\n", to_utf8(jrnl_file).c_str());
+		exit(RC_journal_failed);
+	}
+
+	if (! jrnl.open(jrnl_file, tag))
+	{
+		printf("Error: failed to open the journal - [%s]\n", to_utf8(jrnl_file).c_str());
+		exit(RC_journal_failed);
+	}
+
+	mach_conf.jrnl = &jrnl;
+}
+
+//
+void context::save_scan(const folder & root)
+{
+	api_error_trace err;
+
+	if (save_snapshot(scan_out, root, &err))
+		return;
+
+	printf("Error: failed to save the scan to [%s]\n", to_utf8(scan_out).c_str());
+	if (err.all.size())
+		printf("Error: %s\n", error_to_str(err.all.front()).c_str());
+
+	exit(RC_snapshot_failed);
+}
+
+/*
+ *	The snapshot may well be out of date. Files that are already
+ *	gone are skipped quietly, and anything that was added since
+ *	shows up as 'directory not empty' errors.
+ */
+void context::load_scan(folder & root)
+{
+	api_error_trace  err;
+	snapshot_info    si;
+	ultra_mach_info  temp;
+
+	if (! load_snapshot(scan_in, root, si, &err))
+	{
+		printf("Error: failed to load the scan from [%s]\n", to_utf8(scan_in).c_str());
+		if (err.all.size())
+			printf("Error: %s\n", error_to_str(err.all.front()).c_str());
+
+		exit(RC_snapshot_failed);
+	}
+
+	if (_wcsicmp(root.self.name.c_str(), path.c_str()))
+	{
+		printf("Error: the scan is of a different folder - [%s]\n", to_utf8(root.self.name).c_str());
+		exit(RC_snapshot_failed);
+	}
+
+	mode = 0x01;
+
+	temp.d_found = si.folders;
+	temp.f_found = si.files;
+	temp.b_found = si.bytes;
+	temp.done = true;
+
+	on_ultra_mach_tick(temp);
+}
+
+/*
+ *	Creates a synthetic tree on disk for benchmarking. This is
+ *	kept out of the timed runs, so that these start with the
+ *	same tree and, ideally, a cold cache.
+ */
+void context::generate()
+{
+	api_error_trace  err;
+	tree_sink_disk   sink(&err);
+	tree_gen         gen(&sink, gen_scale);
+	usec_t           t0 = usec();
+
+	printf("Generating [%s] in [%s] ...\n", to_utf8(gen_shape).c_str(), path_utf8.c_str());
+
+	if (! sink.add_folder(path) ||
+	    ! gen.generate(path, gen_shape))
+	{
+		if (err.all.size())
+			printf("Error: %s\n", error_to_str(err.all.front()).c_str());
+
+		exit(RC_generate_failed);
+	}
+
+	printf("Created %zu folders, %zu files, %s in %s\n",
+		gen.folders + 1, gen.files,
+		format_bytes(gen.bytes).c_str(),
+		format_usecs(usec() - t0).c_str());
+}
+
+//
 void context::report()
 {
 	string elapsed   = format_usecs(finished - started);
@@ -691,10 +1198,26 @@ void context::report()
 			print_verbose_stats(true);
 			print_verbose_stats(false);
 			printf("\n");
+
+			if (info.r_queued)
+				printf("Retried %zu times - %zu recovered, %zu failed\n", info.r_queued, info.r_ok, info.r_failed);
+
 			printf("Completed in %s\n", elapsed.c_str());
 		}
 	}
 
+	if (show_latency && ! is_a_file)
+	{
+		report_latency();
+		report_throughput();
+	}
+
+	if (jrnl.errors.all.size())
+		printf("Failed to update the journal - %s\n", error_to_str(jrnl.errors.all.front()).c_str());
+
+	if (trace_file.size() && ! trace.save())
+		printf("Failed to save the trace to [%s]\n", to_utf8(trace_file).c_str());
+
 	if (err_count)
 	{
 		if (list_errors)
@@ -705,6 +1228,52 @@ void context::report()
 	}
 }
 
+void context::report_latency()
+{
+	printf("\n");
+	printf("  Latency  %10s  %10s  %10s  %10s  %10s\n", "Count", "50%", "90%", "99%", "Max");
+
+	report_latency("Scan", info.lat_scan);
+
+	if (preview)
+		return;
+
+	report_latency("File", info.lat_file);
+	report_latency("Folder", info.lat_folder);
+}
+
+void context::report_latency(const char * label, const latency_hist & h)
+{
+	printf("  %-7s  %10I64u  %10s  %10s  %10s  %10s\n", label, h.total,
+		format_latency(h.percentile(50)).c_str(),
+		format_latency(h.percentile(90)).c_str(),
+		format_latency(h.percentile(99)).c_str(),
+		format_latency(h.peak).c_str());
+}
+
+void context::report_throughput()
+{
+	PROCESS_MEMORY_COUNTERS mem = { sizeof mem };
+	uint64_t usecs = max<uint64_t>(finished - started, 1);
+	size_t d = preview ? info.d_found : info.d_deleted;
+	size_t f = preview ? info.f_found : info.f_deleted;
+
+	printf("\n");
+	printf("  Folders/s  %10.0lf\n", d * 1000000. / usecs);
+	printf("  Files/s    %10.0lf\n", f * 1000000. / usecs);
+	printf("  Tail       %10s\n", format_latency(info.tail_usecs).c_str());
+
+	if (! preview)
+		printf("  1st file   %10s\n", format_latency(info.first_usecs).c_str());
+
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &mem, sizeof mem))
+	{
+		printf("  Peak RSS   %10s\n", format_bytes(mem.PeakWorkingSetSize).c_str());
+		printf("  Peak priv  %10s\n", format_bytes(mem.PeakPagefileUsage).c_str());
+		printf("  Per entry  %10s\n", format_bytes(mem.PeakPagefileUsage / max<size_t>(info.d_found + info.f_found, 1)).c_str());
+	}
+}
+
 //
 bool operator < (const api_error & a, const api_error & b)
 {
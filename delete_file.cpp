@@ -16,6 +16,28 @@
 
 #define HSRO (FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_HIDDEN)
 
+/*
+ *	Win32 reports an item that is pending deletion as access denied,
+ *	same as one that can't be deleted at all. Only the former goes
+ *	away by itself, so it's told apart by the NTSTATUS behind it.
+ */
+typedef NTSTATUS (__stdcall * get_status_f)();
+
+// resolved at startup, so that it doesn't clobber the error it's for
+static get_status_f get_status = (get_status_f)GetProcAddress(GetModuleHandle(L"ntdll.dll"), "RtlGetLastNtStatus");
+
+static
+dword get_last_error()
+{
+	dword code = GetLastError();
+
+	if (code == ERROR_ACCESS_DENIED && get_status &&
+	    get_status() == 0xC0000056) // STATUS_DELETE_PENDING
+		code = ERROR_DELETE_PENDING;
+
+	return code;
+}
+
 //
 static
 bool delete_file_win32(const wstring & file, dword attrs, api_error_cb * err)
@@ -26,7 +48,7 @@ bool delete_file_win32(const wstring & file, dword attrs, api_error_cb * err)
 	if (GetLastError() == ERROR_FILE_NOT_FOUND)
 		return true;
 
-	__on_api_error("DeleteFile", file);
+	__on_api_error_ex("DeleteFile", get_last_error(), file);
 	return false;
 }
 
@@ -87,6 +109,6 @@ bool delete_folder(const wstring & folder, dword attrs, api_error_cb * err)
 	    GetLastError() == ERROR_PATH_NOT_FOUND)
 		return true;
 
-	__on_api_error("RemoveDirectory", folder);
+	__on_api_error_ex("RemoveDirectory", get_last_error(), folder);
 	return false;
 }
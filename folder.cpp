@@ -10,6 +10,19 @@
  */
 #include "folder.h"
 
+#include "libp/enforce.h"
+#include "libp/_windows.h"
+
+//
+static const size_t chunk = 256;          // nodes moved between caches at once
+static const size_t slab_nodes = 4096;
+
+static SRWLOCK  pool_lock = SRWLOCK_INIT;
+static vector< pair<folder_pool::node *, size_t> > pool_chunks; // list, count
+static vector<char *> pool_slabs;
+
+static thread_local folder_pool::cache tls_cache = { NULL, 0 };
+
 //
 fsi_item::fsi_item()
 {
@@ -21,39 +34,267 @@ fsi_item::fsi_item(const wc_range & _name, const fsi_info & _info)
 	info = _info;
 }
 
+//
+void file_list::add(const wc_range & name, const fsi_info & info, bool with_bytes)
+{
+	__enforce(names.size() + name.size() < UINT32_MAX);
+
+	names.append(name.ptr, name.end);
+	name_end.push_back( (uint32_t)names.size() );
+	attrs.push_back(info.attrs);
+
+	if (with_bytes)
+		bytes.push_back(info.bytes);
+}
+
+void file_list::append_name(size_t i, wstring & path) const
+{
+	path += L'\\';
+	path.append(names, name_pos(i), name_len(i));
+}
+
+void file_list::clear()
+{
+	names.clear();
+	name_end.clear();
+	attrs.clear();
+	bytes.clear();
+}
+
+void file_list::release()
+{
+	wstring().swap(names);
+	vector<uint32_t>().swap(name_end);
+	vector<dword>().swap(attrs);
+	vector<uint64_t>().swap(bytes);
+}
+
+void file_list::swap(file_list & other)
+{
+	names.swap(other.names);
+	name_end.swap(other.name_end);
+	attrs.swap(other.attrs);
+	bytes.swap(other.bytes);
+}
+
 //
 folder::folder()
 {
 	parent = NULL;
+	index = 0;
 	items = 0;
+	stuck = false;
 }
 
 folder::~folder()
 {
-	for (auto & d : folders)
-		delete d;
+	folder_vec todo;
+
+	// not recursive, trees can be deeper than the stack is
+	todo.swap(folders);
+
+	while (todo.size())
+	{
+		folder * x = todo.back();
+
+		todo.pop_back();
+
+		if (! x) // already deleted by ultra_mach
+			continue;
+
+		todo.insert(todo.end(), x->folders.begin(), x->folders.end());
+		x->folders.clear();
+
+		delete x;
+	}
+}
+
+//
+void * folder::operator new(size_t bytes)
+{
+	__enforce(bytes == sizeof(folder));
+	return folder_pool::get();
 }
 
-wstring folder::get_path() const
+void folder::operator delete(void * ptr)
 {
-	const folder * d = this;
-	wstring  path;
+	if (ptr) folder_pool::put(ptr);
+}
 
-	for ( ; d->parent; d = d->parent)
-		path = L'\\' + d->self.name + path;
+wstring folder::get_path() const
+{
+	wstring path;
 
-	return d->self.name + path;
+	get_path(path);
+	return path;
 }
 
-void folder::census(folder_vec & vec)
+/*
+ *	Sizes the path first and then fills it in back to front. This
+ *	is linear in the depth, and it doesn't allocate if 'path' has
+ *	enough room already.
+ */
+void folder::get_path(wstring & path) const
 {
-	for (auto & x : folders)
-		x->census(vec);
+	const folder * d;
+	size_t len = 0, pos;
+
+	for (d = this; d->parent; d = d->parent)
+		len += 1 + d->self.name.size();
+
+	len += d->self.name.size();
+
+	path.resize(len);
 
-	vec.push_back(this);
+	for (d = this, pos = len; d->parent; d = d->parent)
+	{
+		pos -= d->self.name.size();
+		wmemcpy(&path[pos], d->self.name.data(), d->self.name.size());
+		path[--pos] = L'\\';
+	}
+
+	wmemcpy(&path[0], d->self.name.data(), pos);
 }
 
 bool folder::ready_for_delete() const
 {
 	return (items == 0);
 }
+
+/*
+ *	folder_pool
+ */
+folder_pool::cache::~cache()
+{
+	// thread is exiting, pass its nodes on
+	spill(*this, count);
+}
+
+void * folder_pool::get()
+{
+	cache & c = tls_cache;
+	node  * x;
+
+	if (! c.head)
+		refill(c);
+
+	x = c.head;
+	c.head = x->next;
+	c.count--;
+
+	return x;
+}
+
+void folder_pool::put(void * ptr)
+{
+	cache & c = tls_cache;
+	node  * x = (node *)ptr;
+
+	x->next = c.head;
+	c.head = x;
+	c.count++;
+
+	if (c.count >= 2*chunk)
+		spill(c, chunk);
+}
+
+void folder_pool::refill(cache & c)
+{
+	char * slab;
+
+	AcquireSRWLockExclusive(&pool_lock);
+
+	if (pool_chunks.size())
+	{
+		c.head = pool_chunks.back().first;
+		c.count = pool_chunks.back().second;
+		pool_chunks.pop_back();
+	}
+
+	ReleaseSRWLockExclusive(&pool_lock);
+
+	if (c.head)
+		return;
+
+	slab = (char *)malloc(slab_nodes * sizeof(folder));
+	__enforce(slab);
+
+	AcquireSRWLockExclusive(&pool_lock);
+	pool_slabs.push_back(slab);
+	ReleaseSRWLockExclusive(&pool_lock);
+
+	for (size_t i = slab_nodes; i-- > 0; )
+	{
+		node * x = (node *)(slab + i * sizeof(folder));
+
+		x->next = c.head;
+		c.head = x;
+	}
+
+	c.count = slab_nodes;
+}
+
+void folder_pool::spill(cache & c, size_t n)
+{
+	node * head = c.head;
+	node * tail = c.head;
+
+	if (! n)
+		return;
+
+	for (size_t i = 1; i < n; i++)
+		tail = tail->next;
+
+	c.head = tail->next;
+	c.count -= n;
+	tail->next = NULL;
+
+	AcquireSRWLockExclusive(&pool_lock);
+	pool_chunks.push_back( make_pair(head, n) );
+	ReleaseSRWLockExclusive(&pool_lock);
+}
+
+/*
+ *	Nodes are only counted as free if they are in the pool or in
+ *	the caller's cache, so this has to wait until all other threads
+ *	that had folders on their hands have exited.
+ */
+bool folder_pool::trim()
+{
+	cache & c = tls_cache;
+	size_t  idle = c.count;
+	bool    ok;
+
+	AcquireSRWLockExclusive(&pool_lock);
+
+	for (auto & x : pool_chunks)
+		idle += x.second;
+
+	ok = (idle == pool_slabs.size() * slab_nodes);
+	if (ok)
+	{
+		for (auto & slab : pool_slabs)
+			free(slab);
+
+		pool_slabs.clear();
+		pool_chunks.clear();
+
+		c.head = NULL;
+		c.count = 0;
+	}
+
+	ReleaseSRWLockExclusive(&pool_lock);
+
+	return ok;
+}
+
+size_t folder_pool::slabs()
+{
+	size_t n;
+
+	AcquireSRWLockExclusive(&pool_lock);
+	n = pool_slabs.size();
+	ReleaseSRWLockExclusive(&pool_lock);
+
+	return n;
+}
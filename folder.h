@@ -33,24 +33,86 @@ struct fsi_item
 
 typedef vector<fsi_item> fsi_item_vec;
 
+/*
+ *	Files of a folder as parallel arrays rather than an array of
+ *	fsi_items. Deleting needs just the names and the attributes,
+ *	so that's all it touches, and the sizes are kept only if the
+ *	byte counts are wanted.
+ */
+struct file_list
+{
+	wstring           names;     // back to back, no separators
+	vector<uint32_t>  name_end;  // of each in 'names'
+	vector<dword>     attrs;
+	vector<uint64_t>  bytes;     // empty if not kept
+
+	size_t size() const  { return attrs.size(); }
+	bool   empty() const { return attrs.empty(); }
+
+	size_t   name_pos(size_t i) const  { return i ? name_end[i-1] : 0; }
+	size_t   name_len(size_t i) const  { return name_end[i] - name_pos(i); }
+	uint64_t get_bytes(size_t i) const { return bytes.size() ? bytes[i] : 0; }
+
+	void add(const wc_range & name, const fsi_info & info, bool with_bytes);
+	void append_name(size_t i, wstring & path) const;
+	void clear();    // keeps the memory
+	void release();
+	void swap(file_list & other);
+};
+
 //
 struct folder
 {
 	folder      * parent;
+	size_t        index;   // in parent->folders
 	fsi_item      self;
 
 	folder_vec    folders;
-	fsi_item_vec  files;
+	file_list     files;
 
 	uint32_t      items;
+	bool          stuck;   // something inside failed for good
 
 	//
 	folder();
 	~folder();
 
+	static void * operator new(size_t bytes);   // see folder_pool
+	static void operator delete(void * ptr);
+
 	wstring get_path() const;
-	void census(folder_vec & vec);
+	void get_path(wstring & path) const;
 	bool ready_for_delete() const;
 };
 
+/*
+ *	Folder nodes come from slabs rather than from the heap, via a
+ *	per-thread cache of free nodes. The caches exchange nodes with
+ *	a shared pool in chunks, so the lock is taken once per 'chunk'
+ *	nodes at most, and threads that mostly free nodes don't hoard
+ *	them. Slabs are kept around for reuse until trim() finds all
+ *	their nodes free, and then they are released all at once.
+ */
+struct folder_pool
+{
+	struct node { node * next; };
+
+	struct cache // per thread
+	{
+		node   * head;
+		size_t   count;
+
+		~cache();
+	};
+
+	static void * get();
+	static void put(void * ptr);
+
+	static bool trim();          // frees the slabs if no folders are live
+	static size_t slabs();
+
+	static void refill(cache & c);
+	static void spill(cache & c, size_t n);
+};
+
 #endif
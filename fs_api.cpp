@@ -0,0 +1,71 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#include "fs_api.h"
+#include "delete_file.h"
+
+#include "libp/time.h"
+
+//
+size_t fs_api::delete_files(wstring & folder, const file_list & files, size_t first, size_t count,
+                            uint64_t & bytes, delete_files_cb * cb, api_error_cb * err)
+{
+	size_t base = folder.size();
+	size_t done = 0;
+	usec_t t0;
+	bool   ok;
+
+	for (size_t i = first; i < first + count; i++)
+	{
+		// append the name in place, then cut it off again
+		files.append_name(i, folder);
+
+		t0 = usec();
+		ok = delete_file(folder, files.attrs[i], err);
+
+		folder.resize(base);
+
+		if (ok)
+		{
+			bytes += files.get_bytes(i);
+			done++;
+		}
+
+		if (! cb)
+			continue;
+
+		if (ok ? ! cb->on_file_deleted(i, usec() - t0)
+		       : ! cb->on_file_failed(i))
+			break;
+	}
+
+	return done;
+}
+
+//
+fs_api_native::fs_api_native()
+{
+	ntapi = false;
+}
+
+void fs_api_native::scan_folder(const wstring & path, size_t buf_size, fsi_scan_cb * cb, api_error_cb * err)
+{
+	scan_folder_nt(path.c_str(), buf_size, cb, err);
+}
+
+bool fs_api_native::delete_file(const wstring & file, dword attrs, api_error_cb * err)
+{
+	return ::delete_file(file, attrs, ntapi, err);
+}
+
+bool fs_api_native::delete_folder(const wstring & folder, dword attrs, api_error_cb * err)
+{
+	return ::delete_folder(folder, attrs, err);
+}
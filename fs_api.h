@@ -0,0 +1,70 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#ifndef _ULTRA_FS_API_H_
+#define _ULTRA_FS_API_H_
+
+#include "folder.h"
+
+/*
+ *	Outcome of each file passed to fs_api::delete_files(), in order.
+ *	A failure is reported after the errors that go with it. Return
+ *	false to stop there and skip the rest.
+ */
+struct delete_files_cb
+{
+	__interface(delete_files_cb);
+
+	virtual bool on_file_deleted(size_t i, uint64_t usecs) = 0;
+	virtual bool on_file_failed(size_t i) = 0;
+};
+
+/*
+ *	File system operations that ultra_mach needs. The default is
+ *	fs_api_native, which maps them onto scan_folder_nt() and the
+ *	functions from delete_file.h
+ */
+struct fs_api
+{
+	__interface(fs_api);
+
+	virtual void scan_folder(const wstring & path, size_t buf_size, fsi_scan_cb * cb, api_error_cb * err) = 0;
+
+	virtual bool delete_file(const wstring & file, dword attrs, api_error_cb * err) = 0;
+	virtual bool delete_folder(const wstring & folder, dword attrs, api_error_cb * err) = 0;
+
+	/*
+	 *	Deletes files[first, first+count-1] from 'folder'. Returns
+	 *	the number deleted and adds up their sizes in 'bytes'. The
+	 *	'folder' is a scratch buffer, but it's left as it was.
+	 *
+	 *	The files are deleted one by one, synchronously. This is a
+	 *	hook for reusing per-folder state across them, such as the
+	 *	directory handle in fs_api_relative. The default just calls
+	 *	delete_file() for each one.
+	 */
+	virtual size_t delete_files(wstring & folder, const file_list & files, size_t first, size_t count,
+	                            uint64_t & bytes, delete_files_cb * cb, api_error_cb * err);
+};
+
+//
+struct fs_api_native : fs_api
+{
+	bool  ntapi; // use NtDeleteFile for files
+
+	fs_api_native();
+
+	void scan_folder(const wstring & path, size_t buf_size, fsi_scan_cb * cb, api_error_cb * err);
+
+	bool delete_file(const wstring & file, dword attrs, api_error_cb * err);
+	bool delete_folder(const wstring & folder, dword attrs, api_error_cb * err);
+};
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#include "fs_relative.h"
+#include "delete_file.h"
+#include "utils.h"
+
+#include "libp/_elpify.h"
+#include "libp/_system_api.h"
+#include "libp/_ntstatus.h"
+#include "libp/time.h"
+
+#ifndef FILE_SUPPORTS_POSIX_UNLINK_RENAME
+#define FILE_SUPPORTS_POSIX_UNLINK_RENAME  0x00000400
+#endif
+
+//
+static const size_t lru_max = 16;          // handles per thread
+
+static thread_local fs_api_relative::cache tls_cache;
+
+//
+fs_api_relative::cache::~cache()
+{
+	clear();
+}
+
+void fs_api_relative::cache::clear()
+{
+	for (auto & e : items)
+		CloseHandle(e.handle);
+
+	items.clear();
+	owner = NULL;
+}
+
+/*
+ *
+ */
+fs_api_relative::fs_api_relative()
+{
+	ntapi = true;
+	posix = false;
+}
+
+void fs_api_relative::init(const wstring & root)
+{
+	wchar_t volume[MAX_PATH];
+	dword   flags = 0;
+
+	posix = GetVolumePathNameW(elpify(root).c_str(), volume, MAX_PATH) &&
+	        GetVolumeInformationW(volume, NULL, 0, NULL, NULL, &flags, NULL, 0) &&
+	        (flags & FILE_SUPPORTS_POSIX_UNLINK_RENAME);
+}
+
+//
+bool fs_api_relative::delete_file(const wstring & file, dword attrs, api_error_cb * err)
+{
+	HANDLE folder;
+	size_t pos = file.rfind(L'\\');
+
+	// NtDeleteFile won't touch read-only files
+	if (! posix || pos == -1 || (attrs & FILE_ATTRIBUTE_READONLY))
+		return fs_api_native::delete_file(file, attrs, err);
+
+	folder = get_handle(file.c_str(), pos);
+	if (! folder)
+		return fs_api_native::delete_file(file, attrs, err);
+
+	return delete_at(folder, file.c_str(), pos, file.c_str() + pos + 1, file.size() - pos - 1, err);
+}
+
+/*
+ *	All the files share a single handle lookup, and the names
+ *	are passed to NtDeleteFile straight from the file_list, so
+ *	no paths are built at all unless there's an error to report.
+ */
+size_t fs_api_relative::delete_files(wstring & folder, const file_list & files, size_t first, size_t count,
+                                     uint64_t & bytes, delete_files_cb * cb, api_error_cb * err)
+{
+	HANDLE handle = posix ? get_handle(folder.c_str(), folder.size()) : NULL;
+	size_t base = folder.size();
+	size_t done = 0;
+	usec_t t0;
+
+	for (size_t i = first; i < first + count; i++)
+	{
+		bool ok;
+
+		t0 = usec();
+
+		// goes the long way, see delete_file(), and so does the
+		// lot if there's no handle, without retrying to get one
+		if (! handle || (files.attrs[i] & FILE_ATTRIBUTE_READONLY))
+		{
+			files.append_name(i, folder);
+			ok = fs_api_native::delete_file(folder, files.attrs[i], err);
+			folder.resize(base);
+		}
+		else
+		{
+			ok = delete_at(handle, folder.c_str(), folder.size(),
+			               files.names.data() + files.name_pos(i), files.name_len(i), err);
+		}
+
+		if (ok)
+		{
+			bytes += files.get_bytes(i);
+			done++;
+		}
+
+		if (! cb)
+			continue;
+
+		if (ok ? ! cb->on_file_deleted(i, usec() - t0)
+		       : ! cb->on_file_failed(i))
+			break;
+	}
+
+	return done;
+}
+
+bool fs_api_relative::delete_at(HANDLE handle, const wchar_t * folder, size_t folder_len,
+                                const wchar_t * name, size_t name_len, api_error_cb * err)
+{
+	UNICODE_STRING     str;
+	OBJECT_ATTRIBUTES  attr;
+	NTSTATUS           status;
+	wstring            file;
+
+	str.Buffer = (PWSTR)name;
+	str.Length = (USHORT)(name_len * sizeof(wchar_t));
+	str.MaximumLength = str.Length;
+
+	InitializeObjectAttributes(&attr, &str, OBJ_CASE_INSENSITIVE, handle, NULL);
+
+	status = ntdll.NtDeleteFile(&attr);
+
+	if (status == STATUS_SUCCESS)
+		return true;
+
+	if (status == 0xC0000034) // STATUS_OBJECT_NAME_NOT_FOUND
+		return false;
+
+	file.assign(folder, folder_len);
+	file += L'\\';
+	file.append(name, name_len);
+
+	__on_api_error_ex("NtDeleteFile", status, file);
+	return false;
+}
+
+bool fs_api_relative::delete_folder(const wstring & folder, dword attrs, api_error_cb * err)
+{
+	FILE_DISPOSITION_INFO_EX info;
+	HANDLE h;
+	bool   ok;
+
+	evict(folder);
+
+	if (! posix)
+		return fs_api_native::delete_folder(folder, attrs, err);
+
+	h = elp->CreateFile(folder.c_str(), DELETE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+	                    OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+
+	if (h == INVALID_HANDLE_VALUE)
+	{
+		if (__not_found(GetLastError()))
+			return true;
+
+		return fs_api_native::delete_folder(folder, attrs, err);
+	}
+
+	info.Flags = FILE_DISPOSITION_FLAG_DELETE |
+	             FILE_DISPOSITION_FLAG_POSIX_SEMANTICS |
+	             FILE_DISPOSITION_FLAG_IGNORE_READONLY_ATTRIBUTE;
+
+	ok = SetFileInformationByHandle(h, FileDispositionInfoEx, &info, sizeof info);
+
+	CloseHandle(h);
+
+	// not empty or some such, this will report it properly
+	return ok || fs_api_native::delete_folder(folder, attrs, err);
+}
+
+//
+HANDLE fs_api_relative::get_handle(const wchar_t * folder, size_t len)
+{
+	cache & c = tls_cache;
+	entry   e;
+
+	if (c.owner != this)
+	{
+		c.clear();
+		c.owner = this;
+	}
+
+	for (size_t i = 0; i < c.items.size(); i++)
+	{
+		entry & x = c.items[i];
+
+		if (x.path.size() != len || wmemcmp(x.path.data(), folder, len))
+			continue;
+
+		if (i) // move to front
+			rotate(c.items.begin(), c.items.begin() + i, c.items.begin() + i + 1);
+
+		return c.items.front().handle;
+	}
+
+	e.path.assign(folder, len);
+	e.handle = elp->CreateFile(e.path.c_str(), FILE_LIST_DIRECTORY | FILE_TRAVERSE,
+	                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+	                           OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+
+	if (e.handle == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	if (c.items.size() == lru_max)
+	{
+		CloseHandle(c.items.back().handle);
+		c.items.pop_back();
+	}
+
+	c.items.insert(c.items.begin(), e);
+	return e.handle;
+}
+
+void fs_api_relative::evict(const wstring & folder)
+{
+	cache & c = tls_cache;
+
+	if (c.owner != this)
+		return;
+
+	for (size_t i = 0; i < c.items.size(); i++)
+	{
+		if (c.items[i].path != folder)
+			continue;
+
+		CloseHandle(c.items[i].handle);
+		c.items.erase(c.items.begin() + i);
+		break;
+	}
+}
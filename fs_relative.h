@@ -0,0 +1,69 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#ifndef _ULTRA_FS_RELATIVE_H_
+#define _ULTRA_FS_RELATIVE_H_
+
+#include "fs_api.h"
+#include "libp/_windows.h"
+
+/*
+ *	Deletes files relative to a handle of their folder instead of
+ *	by full path, so that the path is parsed and resolved once per
+ *	folder rather than once per file. Each worker thread keeps a
+ *	few folder handles open, most recently used first.
+ *
+ *	Folders are removed with POSIX semantics, which unlinks them
+ *	right away even if other workers still have them open. If the
+ *	volume doesn't support it (FAT, SMB, older NTFS), the cached
+ *	handles would keep parent folders from being removed, so this
+ *	falls back to fs_api_native then.
+ */
+struct fs_api_relative : fs_api_native
+{
+	struct entry
+	{
+		wstring  path;
+		HANDLE   handle;
+	};
+
+	struct cache // per thread
+	{
+		fs_api_relative * owner;
+		vector<entry>     items;  // most recent first
+
+		~cache();
+		void clear();
+	};
+
+	//
+	fs_api_relative();
+
+	void init(const wstring & root); // checks for POSIX semantics
+
+	/*
+	 *	fs_api
+	 */
+	bool delete_file(const wstring & file, dword attrs, api_error_cb * err);
+	bool delete_folder(const wstring & folder, dword attrs, api_error_cb * err);
+
+	size_t delete_files(wstring & folder, const file_list & files, size_t first, size_t count,
+	                    uint64_t & bytes, delete_files_cb * cb, api_error_cb * err);
+
+	//
+	bool delete_at(HANDLE handle, const wchar_t * folder, size_t folder_len,
+	               const wchar_t * name, size_t name_len, api_error_cb * err);
+	HANDLE get_handle(const wchar_t * folder, size_t len);
+	void evict(const wstring & folder);
+
+	bool  posix;
+};
+
+#endif
@@ -0,0 +1,423 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#include "fs_sim.h"
+#include "utils.h"
+
+#include "libp/enforce.h"
+#include "libp/atomic.h"
+#include "libp/time.h"
+#include "libp/string_utils.h"
+
+//
+static const fs_sim_profile profiles[] =
+{
+	//  name     scan   entry  delete  rmdir  jitter  errors
+	{ "ram",        0,      0,     0,     0,      0,     0 }, // just the overhead
+	{ "ssd",       60,    150,    20,    30,     25,     0 },
+	{ "hdd",     4000,    300,  2500,  3000,     50,     0 },
+	{ "net",     3000,   2000,  1500,  2500,     50,     0 },
+	{ "wan",    25000,   5000, 20000, 25000,     80,     0 },
+};
+
+bool get_fs_sim_profile(const wstring & name, fs_sim_profile & profile)
+{
+	string foo = to_utf8(name);
+
+	for (auto & p : profiles)
+	{
+		if (foo != p.name)
+			continue;
+
+		profile = p;
+		return true;
+	}
+
+	return false;
+}
+
+static
+uint64_t mix(uint64_t x) // splitmix64 finalizer
+{
+	x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static
+uint64_t path_hash(uint64_t seed, const wstring & str)
+{
+	uint64_t h = seed ^ 0xcbf29ce484222325ULL; // fnv-1a
+
+	for (auto c : str)
+	{
+		h ^= (uint16_t)c;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/*
+ *
+ */
+fs_sim::fs_sim()
+{
+	memset(&profile, 0, sizeof profile);
+	root = NULL;
+	InitializeSRWLock(&lock);
+}
+
+fs_sim::~fs_sim()
+{
+	if (root)
+		destroy(root);
+}
+
+void fs_sim::init(const wstring & _root_path, const fs_sim_profile & _profile)
+{
+	__enforce(! root);
+
+	root_path = _root_path;
+	profile = _profile;
+
+	root = new node();
+	root->parent = NULL;
+	root->name = root_path;
+	root->attrs = FILE_ATTRIBUTE_DIRECTORY;
+	root->bytes = 0;
+	root->key = path_hash(0, to_lower(root_path));
+	root->attempts = 0;
+}
+
+fs_sim::node * fs_sim::add(node * parent, const wstring & name, bool dir, uint64_t bytes)
+{
+	node * x = new node();
+
+	x->parent = parent;
+	x->name = name;
+	x->attrs = dir ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+	x->bytes = dir ? 0 : bytes;
+	x->key = path_hash(parent->key, to_lower(name));
+	x->attempts = 0;
+
+	parent->kids[name] = x;
+	return x;
+}
+
+/*
+ *	'depth' levels of 'fanout' folders each, with 'files' files
+ *	in every folder, including the leaves.
+ */
+void fs_sim::populate(size_t depth, size_t fanout, size_t files)
+{
+	vector< pair<node *, size_t> > todo; // folder, level
+
+	todo.push_back( make_pair(root, 0) );
+
+	while (todo.size())
+	{
+		node * x = todo.back().first;
+		size_t level = todo.back().second;
+
+		todo.pop_back();
+
+		for (size_t i = 0; i < files; i++)
+		{
+			wstring name = from_utf8( stringf("file-%05zu.tmp", i) );
+			add(x, name, false, mix(x->key + i) % (64*1024));
+		}
+
+		if (level == depth)
+			continue;
+
+		for (size_t i = 0; i < fanout; i++)
+		{
+			wstring name = from_utf8( stringf("folder-%04zu", i) );
+			todo.push_back( make_pair(add(x, name, true, 0), level+1) );
+		}
+	}
+}
+
+/*
+ *	tree_sink
+ */
+bool fs_sim::add_folder(const wstring & path)
+{
+	return add_path(path, true, 0);
+}
+
+bool fs_sim::add_file(const wstring & path, uint64_t bytes)
+{
+	return add_path(path, false, bytes);
+}
+
+bool fs_sim::add_path(const wstring & path, bool dir, uint64_t bytes)
+{
+	size_t pos = path.rfind(L'\\');
+	node * parent;
+
+	if (pos == -1)
+		return false;
+
+	parent = lookup(path.substr(0, pos));
+	if (! parent || ! (parent->attrs & FILE_ATTRIBUTE_DIRECTORY))
+		return false;
+
+	add(parent, path.substr(pos+1), dir, bytes);
+	return true;
+}
+
+/*
+ *	fs_api
+ */
+void fs_sim::scan_folder(const wstring & path, size_t buf_size, fsi_scan_cb * cb, api_error_cb * err)
+{
+	vector<node *>  kids;
+	node          * x;
+	uint64_t        dice;
+
+	AcquireSRWLockShared(&lock);
+
+	x = lookup(path);
+	if (x)
+	{
+		for (auto & kv : x->kids)
+			kids.push_back(kv.second);
+
+		dice = roll(x);
+	}
+
+	ReleaseSRWLockShared(&lock);
+
+	if (! x)
+	{
+		__on_api_error_ex("NtOpenFile", 0xC0000034, path); // STATUS_OBJECT_NAME_NOT_FOUND
+		return;
+	}
+
+	delay(profile.scan_usecs + kids.size() * profile.entry_nsecs / 1000, dice);
+
+	cb->on_fsi_open(NULL);
+
+	// the nodes can't go away, because the caller won't try and
+	// delete anything in this folder until the scan is over, save
+	// for the files it has already seen when streaming
+
+	for (auto & kid : kids)
+	{
+		fsi_info info;
+
+		info.attrs = kid->attrs;
+		info.bytes = kid->bytes;
+
+		if (! cb->on_fsi_scan( wc_range(kid->name.c_str(), kid->name.c_str() + kid->name.size()), info ))
+			break;
+	}
+}
+
+bool fs_sim::delete_file(const wstring & file, dword attrs, api_error_cb * err)
+{
+	node   * x;
+	uint64_t dice;
+	dword    code = 0;
+
+	AcquireSRWLockShared(&lock);
+
+	x = lookup(file);
+	if (x) dice = roll(x);
+
+	ReleaseSRWLockShared(&lock);
+
+	if (! x)
+		return true; // same as DeleteFile()
+
+	delay(profile.delete_usecs, dice);
+
+	// 'x' may be gone by now if someone else deleted it too, so
+	// it's looked up again and then checked and unlinked in one go
+
+	AcquireSRWLockExclusive(&lock);
+
+	x = lookup(file);
+
+	if (x)
+	{
+		if (x->attrs & FILE_ATTRIBUTE_DIRECTORY)
+			code = ERROR_ACCESS_DENIED;
+		else
+		if (fail(dice))
+			code = ERROR_SHARING_VIOLATION;
+		else
+			unlink(x);
+	}
+
+	ReleaseSRWLockExclusive(&lock);
+
+	if (code)
+	{
+		__on_api_error_ex("DeleteFile", code, file);
+		return false;
+	}
+
+	if (x)
+		destroy(x);
+
+	return true;
+}
+
+bool fs_sim::delete_folder(const wstring & folder, dword attrs, api_error_cb * err)
+{
+	node   * x;
+	uint64_t dice;
+	dword    code = 0;
+
+	AcquireSRWLockShared(&lock);
+
+	x = lookup(folder);
+	if (x) dice = roll(x);
+
+	ReleaseSRWLockShared(&lock);
+
+	if (! x)
+		return true; // same as RemoveDirectory()
+
+	delay(profile.rmdir_usecs, dice);
+
+	// same as in delete_file()
+
+	AcquireSRWLockExclusive(&lock);
+
+	x = lookup(folder);
+
+	if (x)
+	{
+		if (x->kids.size())
+			code = ERROR_DIR_NOT_EMPTY;
+		else
+		if (fail(dice))
+			code = ERROR_SHARING_VIOLATION;
+		else
+		if (x == root)
+			x = NULL; // keep the tree itself around
+		else
+			unlink(x);
+	}
+
+	ReleaseSRWLockExclusive(&lock);
+
+	if (code)
+	{
+		__on_api_error_ex("RemoveDirectory", code, folder);
+		return false;
+	}
+
+	if (x)
+		destroy(x);
+
+	return true;
+}
+
+//
+int fs_sim::name_less::cmp(const wchar_t * a, size_t a_len, const wchar_t * b, size_t b_len)
+{
+	int r = _wcsnicmp(a, b, min(a_len, b_len));
+
+	if (r) return r;
+
+	return (a_len < b_len) ? -1 : (a_len > b_len);
+}
+
+/*
+ *	Doesn't allocate, so that it's cheap enough not to skew the
+ *	benchmarks of what runs on top of it
+ */
+fs_sim::node * fs_sim::lookup(const wstring & path)
+{
+	node * x = root;
+	size_t pos, end;
+
+	if (path.size() < root_path.size() ||
+	    _wcsnicmp(path.c_str(), root_path.c_str(), root_path.size()))
+		return NULL;
+
+	for (pos = root_path.size(); x && pos < path.size(); pos = end)
+	{
+		if (path[pos] != L'\\')
+			return NULL;
+
+		end = path.find(L'\\', ++pos);
+		if (end == -1)
+			end = path.size();
+
+		name_ref name = { path.c_str() + pos, end - pos };
+		auto it = x->kids.find(name);
+		x = (it != x->kids.end()) ? it->second : NULL;
+	}
+
+	return x;
+}
+
+void fs_sim::unlink(node * x)
+{
+	__enforce(x->parent);
+	x->parent->kids.erase(x->name);
+	x->parent = NULL;
+}
+
+void fs_sim::destroy(node * x)
+{
+	vector<node *> todo;
+
+	todo.push_back(x);
+
+	while (todo.size())
+	{
+		x = todo.back();
+		todo.pop_back();
+
+		for (auto & kv : x->kids)
+			todo.push_back(kv.second);
+
+		delete x;
+	}
+}
+
+//
+uint64_t fs_sim::roll(node * x)
+{
+	// lock is held, shared at least
+	return mix(x->key + atomic_inc(&x->attempts) - 1);
+}
+
+void fs_sim::delay(uint64_t usecs, uint64_t dice)
+{
+	uint64_t until;
+
+	if (profile.jitter_pct)
+	{
+		int64_t spread = usecs * profile.jitter_pct / 100;
+		usecs += (int64_t)(dice % (2*spread + 1)) - spread;
+	}
+
+	until = usec().raw + usecs;
+
+	if (usecs > 2000)
+		Sleep( (dword)(usecs/1000 - 1) );
+
+	while (usec().raw < until)
+		YieldProcessor();
+}
+
+bool fs_sim::fail(uint64_t dice)
+{
+	return (dice >> 32) % 1000000 < profile.error_ppm;
+}
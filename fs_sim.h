@@ -0,0 +1,125 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#ifndef _ULTRA_FS_SIM_H_
+#define _ULTRA_FS_SIM_H_
+
+#include "fs_api.h"
+#include "tree_gen.h"
+#include "libp/_windows.h"
+
+/*
+ *	In-memory file system with simulated latencies and injected
+ *	errors, for measuring how ultra_mach behaves with different
+ *	thread counts, batch sizes and scheduling policies without
+ *	touching an actual disk.
+ *
+ *	Latencies are busy-waited below a couple of msecs and slept
+ *	through above that, i.e. the SSD profile burns the CPU much
+ *	like the real thing would, while the network one doesn't.
+ *
+ *	Jitter and errors are derived from the hash of the path and
+ *	the number of prior attempts on it, so given the same tree
+ *	the same operations are slow and the same ones fail from one
+ *	run to the next, regardless of which thread gets to do them.
+ */
+struct fs_sim_profile
+{
+	const char * name;
+
+	uint32_t  scan_usecs;     // per scan_folder() call
+	uint32_t  entry_nsecs;    // ... plus this much per entry
+	uint32_t  delete_usecs;   // per file
+	uint32_t  rmdir_usecs;    // per folder
+	uint32_t  jitter_pct;     // +/- this much on the above
+	uint32_t  error_ppm;      // failed deletes, per million
+};
+
+bool get_fs_sim_profile(const wstring & name, fs_sim_profile & profile);
+
+//
+struct fs_sim : fs_api, tree_sink
+{
+	struct node;
+
+	struct name_ref // a path component, looked up in place
+	{
+		const wchar_t * ptr;
+		size_t          len;
+	};
+
+	struct name_less // case-insensitive
+	{
+		typedef void is_transparent;
+
+		static int cmp(const wchar_t * a, size_t a_len, const wchar_t * b, size_t b_len);
+
+		bool operator()(const wstring & a, const wstring & b) const  { return cmp(a.c_str(), a.size(), b.c_str(), b.size()) < 0; }
+		bool operator()(const wstring & a, const name_ref & b) const { return cmp(a.c_str(), a.size(), b.ptr, b.len) < 0; }
+		bool operator()(const name_ref & a, const wstring & b) const { return cmp(a.ptr, a.len, b.c_str(), b.size()) < 0; }
+	};
+
+	typedef map<wstring, node *, name_less> node_map;
+
+	struct node
+	{
+		node      * parent;
+		wstring     name;
+		dword       attrs;
+		uint64_t    bytes;
+		uint64_t    key;       // hash of the path
+		size_t      attempts;  // bumped atomically, see roll()
+		node_map    kids;
+	};
+
+	//
+	fs_sim();
+	~fs_sim();
+
+	__no_copying(fs_sim);
+
+	void init(const wstring & root_path, const fs_sim_profile & profile);
+
+	node * add(node * parent, const wstring & name, bool dir, uint64_t bytes);
+	void populate(size_t depth, size_t fanout, size_t files);
+
+	/*
+	 *	tree_sink
+	 */
+	bool add_folder(const wstring & path);
+	bool add_file(const wstring & path, uint64_t bytes);
+	bool add_path(const wstring & path, bool dir, uint64_t bytes);
+
+	/*
+	 *	fs_api
+	 */
+	void scan_folder(const wstring & path, size_t buf_size, fsi_scan_cb * cb, api_error_cb * err);
+
+	bool delete_file(const wstring & file, dword attrs, api_error_cb * err);
+	bool delete_folder(const wstring & folder, dword attrs, api_error_cb * err);
+
+	//
+	node * lookup(const wstring & path);
+	void unlink(node * x);
+	void destroy(node * x); // with all its kids
+
+	uint64_t roll(node * x); // pseudo-random, keyed by path and attempt
+
+	void delay(uint64_t usecs, uint64_t dice);
+	bool fail(uint64_t dice);
+
+	//
+	fs_sim_profile  profile;
+	wstring         root_path;
+	node          * root;
+	SRWLOCK         lock;
+};
+
+#endif
@@ -0,0 +1,298 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#include "journal.h"
+#include "utils.h"
+
+#include "libp/enforce.h"
+#include "libp/string_utils.h"
+#include "libp/_elpify.h"
+
+//
+static const dword  flush_msecs = 500;
+static const size_t batch_max = 4096;    // lines, wake the writer early
+
+//
+journal::journal()
+{
+	fh = INVALID_HANDLE_VALUE;
+	thread = NULL;
+	wakeup = NULL;
+	stop = false;
+	stale = false;
+	queued_n = 0;
+
+	InitializeSRWLock(&lock);
+}
+
+journal::~journal()
+{
+	close();
+}
+
+//
+bool journal::load(const wstring & _file, const string & tag)
+{
+	LARGE_INTEGER size;
+	HANDLE h;
+	string data;
+	dword  n;
+
+	h = elp->CreateFile(_file.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return __not_found(GetLastError()); // nothing to resume
+
+	if (! GetFileSizeEx(h, &size))
+	{
+		CloseHandle(h);
+		return false;
+	}
+
+	data.resize((size_t)size.QuadPart);
+
+	for (size_t pos = 0; pos < data.size(); pos += n)
+	{
+		dword chunk = (dword)min<size_t>(data.size() - pos, 64*1024*1024);
+
+		if (! ReadFile(h, &data[pos], chunk, &n, NULL) || ! n)
+		{
+			CloseHandle(h);
+			return false;
+		}
+	}
+
+	CloseHandle(h);
+
+	if (data.empty())
+		return true;
+
+	if (data.compare(0, tag.size()+3, "# " + tag + '\n') &&
+	    data.compare(0, tag.size()+4, "# " + tag + "\r\n"))
+	{
+		stale = true;
+		return false;
+	}
+
+	for (size_t pos = 0, end; (end = data.find('\n', pos)) != -1; pos = end + 1)
+	{
+		size_t len = end - pos;
+
+		if (len && data[end-1] == '\r')
+			len--;
+
+		if (len && data[pos] != '#')
+			done.insert( to_lower(from_utf8(data.substr(pos, len))) );
+	}
+
+	return true;
+}
+
+bool journal::open(const wstring & _file, const string & tag)
+{
+	LARGE_INTEGER size;
+
+	__enforce(! thread);
+
+	file = _file;
+
+	fh = elp->CreateFile(file.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fh == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (! GetFileSizeEx(fh, &size))
+		return false;
+
+	if (! size.QuadPart && ! write("# " + tag + '\n'))
+		return false;
+
+	wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (! wakeup)
+		return false;
+
+	thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+	return thread != NULL;
+}
+
+void journal::close()
+{
+	if (thread)
+	{
+		stop = true;
+		SetEvent(wakeup);
+
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+		thread = NULL;
+	}
+
+	if (wakeup)
+	{
+		CloseHandle(wakeup);
+		wakeup = NULL;
+	}
+
+	if (fh != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(fh);
+		fh = INVALID_HANDLE_VALUE;
+	}
+}
+
+/*
+ *	Once the run is through, there's nothing left to resume and
+ *	the journal would only get in the way of the next one.
+ */
+bool journal::discard()
+{
+	close();
+
+	if (file.empty())
+		return true;
+
+	return elp->DeleteFile(file.c_str()) || __not_found(GetLastError());
+}
+
+//
+void journal::add(const wstring & folder)
+{
+	string line = to_utf8(folder);
+	bool   full;
+
+	line += '\n';
+
+	AcquireSRWLockExclusive(&lock);
+	queued += line;
+	full = (++queued_n == batch_max);
+	ReleaseSRWLockExclusive(&lock);
+
+	if (full)
+		SetEvent(wakeup);
+}
+
+/*
+ *	Drops deleted folders from the tree, along with everything
+ *	underneath them, and fixes up the item counts to match.
+ */
+size_t journal::prune(folder & root)
+{
+	vector< pair<folder *, wstring> > todo; // folder, lowercased path
+	size_t dropped = 0;
+
+	if (done.empty())
+		return 0;
+
+	todo.push_back( make_pair(&root, to_lower(root.get_path())) );
+
+	if (done.count(todo.back().second))
+	{
+		// all gone, bar perhaps the root itself
+		for (auto & sub : root.folders)
+			delete sub;
+
+		dropped = root.folders.size();
+
+		root.folders.clear();
+		root.files.release();
+		root.items = 0;
+		return dropped;
+	}
+
+	while (todo.size())
+	{
+		folder   * x = todo.back().first;
+		wstring    path;
+		folder_vec keep;
+
+		path.swap(todo.back().second);
+		todo.pop_back();
+
+		for (auto & sub : x->folders)
+		{
+			wstring sub_path = path + L'\\' + to_lower(sub->self.name);
+
+			if (done.count(sub_path))
+			{
+				delete sub;
+				dropped++;
+				continue;
+			}
+
+			sub->index = keep.size();
+			keep.push_back(sub);
+
+			todo.push_back( make_pair(sub, sub_path) );
+		}
+
+		x->folders.swap(keep);
+		x->items = (uint32_t)(x->files.size() + x->folders.size());
+	}
+
+	return dropped;
+}
+
+//
+void journal::write_loop()
+{
+	string data;
+
+	for (bool last = false; ! last; )
+	{
+		WaitForSingleObject(wakeup, flush_msecs);
+
+		last = stop; // then drain whatever is left
+
+		AcquireSRWLockExclusive(&lock);
+		data.swap(queued);
+		queued_n = 0;
+		ReleaseSRWLockExclusive(&lock);
+
+		if (data.size())
+		{
+			write(data);
+			data.clear();
+		}
+	}
+}
+
+bool journal::write(const string & data)
+{
+	api_error_cb * err = &errors;
+	const char * ptr = data.c_str();
+	size_t left = data.size();
+	dword  n;
+
+	for ( ; left; ptr += n, left -= n)
+	{
+		if (! WriteFile(fh, ptr, (dword)min<size_t>(left, 64*1024*1024), &n, NULL))
+		{
+			if (errors.all.empty())
+				__on_api_error("WriteFile", file);
+
+			return false;
+		}
+	}
+
+	// the whole point is to survive a crash
+	if (! FlushFileBuffers(fh))
+	{
+		if (errors.all.empty())
+			__on_api_error("FlushFileBuffers", file);
+
+		return false;
+	}
+
+	return true;
+}
+
+dword __stdcall journal::thread_proc(void * arg)
+{
+	((journal *)arg)->write_loop();
+	return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#ifndef _ULTRA_JOURNAL_H_
+#define _ULTRA_JOURNAL_H_
+
+#include "folder.h"
+#include "libp/_windows.h"
+
+/*
+ *	A log of deleted folders, for picking up an interrupted run
+ *	where it left off.
+ *
+ *	It's a UTF-8 text file with one full path per line. Workers
+ *	merely queue the paths, and a separate thread writes them out
+ *	and flushes them to disk in batches. A line cut short by a
+ *	crash has no line break and is ignored when loading.
+ *
+ *	The first line is '# <tag>', where the tag identifies the
+ *	snapshot the run was started from. A journal is only good for
+ *	the tree it was written against, so load() refuses one with a
+ *	different tag.
+ *
+ *	On resume, prune() drops the deleted folders from a prescanned
+ *	tree, so these aren't revisited at all.
+ */
+struct journal
+{
+	journal();
+	~journal();
+
+	__no_copying(journal);
+
+	bool load(const wstring & file, const string & tag);  // OK if it doesn't exist
+	bool open(const wstring & file, const string & tag);  // for appending, starts the writer
+	void close();                      // flush and stop the writer
+	bool discard();                    // close and delete the file
+
+	void add(const wstring & folder);  // any thread, doesn't block on I/O
+	size_t prune(folder & root);       // returns the number of folders dropped
+
+	void write_loop();
+	bool write(const string & data);
+	static dword __stdcall thread_proc(void * arg);
+
+	//
+	wstring          file;
+	set<wstring>     done;     // lowercased, from load()
+	bool             stale;    // load() saw a different tag
+
+	HANDLE           fh;
+	HANDLE           thread;
+	HANDLE           wakeup;
+	volatile bool    stop;
+
+	SRWLOCK          lock;
+	string           queued;   // lines yet to be written
+	size_t           queued_n;
+
+	api_error_trace  errors;   // of the writer
+};
+
+#endif
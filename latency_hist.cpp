@@ -0,0 +1,66 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#include "latency_hist.h"
+
+#include <intrin.h>
+
+//
+latency_hist::latency_hist()
+{
+	memset(counts, 0, sizeof counts);
+	total = 0;
+	peak = 0;
+}
+
+void latency_hist::add(uint64_t usecs)
+{
+	unsigned long i = 0;
+
+	_BitScanReverse64(&i, usecs | 1);
+
+	counts[ min<size_t>(i, buckets-1) ]++;
+	total++;
+
+	if (peak < usecs)
+		peak = usecs;
+}
+
+void latency_hist::merge(const latency_hist & other)
+{
+	for (size_t i = 0; i < buckets; i++)
+		counts[i] += other.counts[i];
+
+	total += other.total;
+
+	if (peak < other.peak)
+		peak = other.peak;
+}
+
+uint64_t latency_hist::percentile(double pct) const
+{
+	uint64_t want, seen = 0;
+
+	if (! total)
+		return 0;
+
+	want = (uint64_t)(total * pct / 100);
+	if (want < 1)
+		want = 1;
+
+	for (size_t i = 0; i < buckets; i++)
+	{
+		seen += counts[i];
+		if (seen >= want)
+			return min<uint64_t>(2ULL << i, peak);
+	}
+
+	return peak;
+}
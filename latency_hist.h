@@ -0,0 +1,41 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#ifndef _ULTRA_LATENCY_HIST_H_
+#define _ULTRA_LATENCY_HIST_H_
+
+#include "libp/types.h"
+
+/*
+ *	Log2-bucketed histogram of operation latencies, in usecs.
+ *
+ *	Bucket 'i' counts samples in [2^i, 2^(i+1)), with the 0th one
+ *	also taking zeros. Adding a sample is a bit scan and a couple
+ *	of increments, so it's cheap enough to be always on as long
+ *	as each thread has its own instance.
+ */
+struct latency_hist
+{
+	enum { buckets = 40 };
+
+	uint64_t  counts[buckets];
+	uint64_t  total;
+	uint64_t  peak;
+
+	//
+	latency_hist();
+
+	void add(uint64_t usecs);
+	void merge(const latency_hist & other);
+
+	uint64_t percentile(double pct) const; // upper bound, in usecs
+};
+
+#endif
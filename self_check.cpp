@@ -0,0 +1,844 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#include "self_check.h"
+#include "steal_queue.h"
+#include "thread_tuner.h"
+#include "ultra_machine.h"
+#include "fs_sim.h"
+#include "journal.h"
+#include "snapshot.h"
+
+#include "libp/enforce.h"
+#include "libp/atomic.h"
+#include "libp/time.h"
+#include "libp/_windows.h"
+
+//
+static const char * current = "";
+
+#define __check(x)  if (! (x)) { printf("  %-16s failed, line %d: %s\n", current, __LINE__, #x); return false; }
+
+/*
+ *	steal_queue
+ */
+struct counted_item : work_item
+{
+	volatile size_t   runs;
+	volatile size_t * left;
+	HANDLE            done;
+
+	void execute()
+	{
+		atomic_inc(&runs);
+
+		if (atomic_dec(left) == 0)
+			SetEvent(done);
+	}
+};
+
+struct spawner_item : work_item // enqueues from a worker
+{
+	steal_queue  * queue;
+	counted_item * first;
+	size_t         count;
+
+	void execute()
+	{
+		for (size_t i = 0; i < count; i++)
+			queue->enqueue(first + i, i % queue->levels);
+	}
+};
+
+struct blocker_item : work_item
+{
+	HANDLE  started;
+	HANDLE  release;
+
+	void execute()
+	{
+		SetEvent(started);
+		WaitForSingleObject(release, INFINITE);
+	}
+};
+
+static
+bool check_queue_mode(size_t levels, bool lifo)
+{
+	const size_t n = 100*1000;
+
+	vector<counted_item> items(n);
+	volatile size_t left = n;
+	spawner_item spawner;
+	work_item_vec out;
+	steal_queue q;
+	HANDLE done;
+
+	done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	__check(done);
+
+	for (auto & wi : items)
+	{
+		wi.runs = 0;
+		wi.left = &left;
+		wi.done = done;
+	}
+
+	__check( q.init(8, levels, lifo) );
+
+	// half from outside, half from a worker, the latter with
+	// only two workers active, so the rest is to be stolen
+
+	spawner.queue = &q;
+	spawner.first = &items[n/2];
+	spawner.count = n - n/2;
+
+	for (size_t i = 0; i < n/2; i++)
+		q.enqueue(&items[i], i % levels);
+
+	q.set_active(2);
+	q.enqueue(&spawner, 0);
+
+	__check( WaitForSingleObject(done, 10*1000) == WAIT_OBJECT_0 );
+
+	q.cancel(out);
+	CloseHandle(done);
+
+	__check( out.empty() );
+
+	for (auto & wi : items)
+		__check( wi.runs == 1 );
+
+	return true;
+}
+
+static
+bool check_steal_queue()
+{
+	blocker_item blocker;
+	counted_item items[10];
+	volatile size_t left = 10;
+	work_item_vec out;
+
+	__check( check_queue_mode(1, false) );
+	__check( check_queue_mode(1, true) );
+	__check( check_queue_mode(2, true) );
+
+	// cancel() hands back whatever didn't get to run
+	{
+		steal_queue q;
+
+		blocker.started = CreateEvent(NULL, TRUE, FALSE, NULL);
+		blocker.release = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+		__check( q.init(1, 1, true) );
+
+		q.enqueue(&blocker, 0);
+		__check( WaitForSingleObject(blocker.started, 10*1000) == WAIT_OBJECT_0 );
+
+		for (auto & wi : items)
+		{
+			wi.runs = 0;
+			wi.left = &left;
+			wi.done = NULL;
+			q.enqueue(&wi, 0);
+		}
+
+		q.halt();
+		SetEvent(blocker.release);
+		q.cancel(out);
+
+		CloseHandle(blocker.started);
+		CloseHandle(blocker.release);
+	}
+
+	__check( out.size() == 10 );
+
+	for (auto & wi : items)
+		__check( wi.runs == 0 );
+
+	// items enqueued right after shrinking with everyone asleep,
+	// as it happens with '-t auto', are still picked up
+	for (size_t round = 0; round < 20; round++)
+	{
+		steal_queue q;
+		counted_item wi;
+		volatile size_t one = 1;
+
+		wi.runs = 0;
+		wi.left = &one;
+		wi.done = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+		__check( q.init(8, 1, true) );
+
+		while (q.sleepers < 8)
+			Sleep(1);
+
+		q.set_active(1 + round % 3);
+		q.enqueue(&wi, 0);
+
+		__check( WaitForSingleObject(wi.done, 10*1000) == WAIT_OBJECT_0 );
+
+		q.cancel(out);
+		CloseHandle(wi.done);
+	}
+
+	return true;
+}
+
+/*
+ *	thread_tuner, fed with a made-up throughput curve
+ */
+static
+size_t run_tuner(size_t knee, size_t periods, size_t & peak)
+{
+	thread_tuner t;
+	uint64_t ops = 0;
+	usec_t   now;
+	size_t   n;
+
+	t.init(1, 64, 4);
+
+	now.raw = 1;
+	n = t.tick(ops, now);
+	peak = n;
+
+	for (size_t i = 0; i < periods; i++)
+	{
+		// linear up to the knee, flat after, none at all if 0
+		ops += min(n, knee) * 1000 * t.period.raw / 1000000;
+		now.raw += t.period.raw;
+
+		n = t.tick(ops, now);
+		peak = max(peak, n);
+	}
+
+	return n;
+}
+
+static
+bool check_tuner()
+{
+	size_t n, peak;
+
+	// idle - stays put
+	n = run_tuner(0, 100, peak);
+	__check( n == 4 && peak == 4 );
+
+	// more threads don't help - sheds them
+	n = run_tuner(1, 100, peak);
+	__check( n <= 2 && peak <= 5 );
+
+	// settles around the knee without running off
+	n = run_tuner(8, 200, peak);
+	__check( n >= 5 && n <= 12 && peak <= 16 );
+
+	return true;
+}
+
+/*
+ *	ultra_mach, on a simulated tree with no latencies
+ */
+struct sim_check : ultra_mach_cb
+{
+	fs_sim           sim;
+	folder           root;
+	ultra_mach_conf  conf;
+	ultra_mach_info  info;
+	size_t           folders, files;  // in the tree, with the root
+	size_t           errors;
+	size_t           scan_errors;     // ... of these
+	size_t           stop_at;         // cancel past this many files deleted
+	usec_t           stopped;         // when it was cancelled
+
+	//
+	sim_check(size_t depth, size_t fanout, size_t files_per);
+
+	bool run(bool staged);  // false if cancelled
+	bool all_gone() const;
+
+	bool on_ultra_mach_tick(const ultra_mach_info & info);
+};
+
+sim_check::sim_check(size_t depth, size_t fanout, size_t files_per)
+{
+	const wchar_t * path = L"X:\\self-check";
+	fs_sim_profile profile;
+
+	__enforce( get_fs_sim_profile(L"ram", profile) );
+
+	sim.init(path, profile);
+	sim.populate(depth, fanout, files_per);
+
+	folders = 0;
+	for (size_t level = 0, n = 1; level <= depth; level++, n *= fanout)
+		folders += n;
+
+	files = folders * files_per;
+	errors = 0;
+	scan_errors = 0;
+	stop_at = -1;
+	stopped.raw = 0;
+
+	root.self.name = path;
+	root.self.info.attrs = FILE_ATTRIBUTE_DIRECTORY;
+
+	conf.threads = 4;
+	conf.fs = &sim;
+}
+
+bool sim_check::run(bool staged)
+{
+	info = ultra_mach_info();
+	errors = 0;
+	scan_errors = 0;
+	stopped.raw = 0;
+
+	if (! staged)
+		return ultra_mach_delete(root, false, conf, this);
+
+	if (! ultra_mach_scan(root, conf, this))
+		return false;
+
+	return ultra_mach_delete(root, true, conf, this);
+}
+
+bool sim_check::all_gone() const
+{
+	for (auto & x : root.folders)
+		if (x) return false; // not freed
+
+	return sim.root->kids.empty();
+}
+
+bool sim_check::on_ultra_mach_tick(const ultra_mach_info & _info)
+{
+	if (_info.scanner_err) scan_errors += _info.scanner_err->size();
+	if (_info.scanner_err) errors      += _info.scanner_err->size();
+	if (_info.deleter_err) errors      += _info.deleter_err->size();
+
+	info = _info;
+	info.scanner_err = NULL;
+	info.deleter_err = NULL;
+
+	if (info.f_deleted < stop_at)
+		return true;
+
+	if (! stopped.raw)
+		stopped = usec();
+
+	return false;
+}
+
+/*
+ *	Everything is deleted and every node is freed, whichever the
+ *	order the tasks happen to complete in.
+ */
+static
+bool check_completion()
+{
+	static const size_t threads[] = { 1, 4, 32 };
+
+	for (auto t : threads)
+	for (int depth_first = 0; depth_first < 2; depth_first++)
+	for (int staged = 0; staged < 2; staged++)
+	{
+		sim_check x(4, 6, 20);
+
+		x.conf.threads = t;
+		x.conf.depth_first = (depth_first > 0);
+
+		__check( x.run(staged > 0) );
+		__check( x.info.done && ! x.errors );
+		__check( x.info.d_deleted == x.folders );
+		__check( x.info.f_deleted == x.files );
+		__check( x.info.lat_file.total == x.files ); // one sample per file
+		__check( x.all_gone() );
+	}
+
+	// staged, with the smallest window there is
+	for (auto t : threads)
+	{
+		sim_check x(4, 4, 5);
+
+		x.conf.threads = t;
+		x.conf.deleter_window = 1;
+
+		__check( x.run(true) );
+		__check( x.info.done && ! x.errors );
+		__check( x.info.d_deleted == x.folders );
+		__check( x.all_gone() );
+	}
+
+	// pipelined, in chunks that don't divide the file counts
+	for (auto t : threads)
+	{
+		sim_check x(2, 4, 1000);
+
+		x.conf.threads = t;
+		x.conf.scanner_chunk = 300;
+
+		__check( x.run(false) );
+		__check( x.info.done && ! x.errors );
+		__check( x.info.d_deleted == x.folders );
+		__check( x.info.f_deleted == x.files );
+		__check( x.info.lat_file.total == x.files );
+		__check( x.all_gone() );
+	}
+
+	// streamed, with files failing to go and not retried
+	for (int fail = 0; fail < 2; fail++)
+	{
+		sim_check x(3, 6, 40);
+
+		x.conf.streaming = true;
+		x.conf.retries = 0;
+		x.sim.profile.error_ppm = fail ? 100*1000 : 0;
+
+		__check( x.run(false) );
+		__check( x.info.done && ! x.scan_errors );
+		__check( x.info.f_found == x.files );
+
+		if (fail)
+		{
+			__check( x.errors && x.info.f_deleted < x.files );
+		}
+		else
+		{
+			__check( ! x.errors && x.info.f_deleted == x.files );
+			__check( x.all_gone() );
+		}
+	}
+
+	// leaves and empty folders only, and a kept root
+	{
+		sim_check x(6, 3, 0);
+
+		x.conf.keep_root = true;
+
+		__check( x.run(false) );
+		__check( x.info.d_found == x.folders );
+		__check( x.info.d_deleted == x.folders - 1 );
+		__check( x.all_gone() );
+	}
+
+	return true;
+}
+
+/*
+ *	Cancelling with workers of both pools busy, including those
+ *	refilling the scanners from the deleters' completions.
+ */
+static
+bool check_cancel()
+{
+	for (int mode = 0; mode < 3; mode++) // scan & delete, staged, pipelined
+	{
+		sim_check x(3, 10, 50);
+		folder again;
+
+		x.sim.profile.delete_usecs = 50;
+		x.conf.threads = 8;
+		x.conf.deleter_window = 16;
+		x.conf.scanner_chunk = (mode == 2) ? 16 : 0;
+		x.stop_at = 1;
+
+		__check( ! x.run(mode == 1) );
+		__check( x.info.f_deleted < x.files );
+
+		// whatever is left is still there to be deleted
+		x.stop_at = -1;
+		again.self = x.root.self;
+
+		__check( ultra_mach_delete(again, false, x.conf, &x) );
+		__check( ! x.errors && x.sim.root->kids.empty() );
+	}
+
+	// time to stop, with every worker busy with a slow operation
+	for (int staged = 0; staged < 2; staged++)
+	{
+		const uint64_t op_usecs = 200*1000;
+		const uint64_t tick_usecs = 50*1000;  // see ultra_machine.cpp
+		const uint64_t slack_usecs = 100*1000; // for the scheduler
+		sim_check x(2, 8, 20);
+		uint64_t took;
+
+		x.sim.profile.scan_usecs = (uint32_t)op_usecs;
+		x.sim.profile.delete_usecs = (uint32_t)op_usecs;
+		x.sim.profile.rmdir_usecs = (uint32_t)op_usecs;
+		x.sim.profile.jitter_pct = 0;
+		x.conf.threads = 16;
+		x.stop_at = 1;
+
+		__check( ! x.run(staged > 0) );
+
+		took = usec() - x.stopped;
+		__check( x.stopped.raw && took <= op_usecs + tick_usecs + slack_usecs );
+	}
+
+	return true;
+}
+
+/*
+ *	fs_sim, but with one file that can't be deleted at all
+ */
+struct denier : fs_api
+{
+	fs_sim  * sim;
+	wstring   deny;
+
+	void scan_folder(const wstring & path, size_t buf_size, fsi_scan_cb * cb, api_error_cb * err)
+	{
+		sim->scan_folder(path, buf_size, cb, err);
+	}
+
+	bool delete_file(const wstring & file, dword attrs, api_error_cb * err)
+	{
+		if (file != deny)
+			return sim->delete_file(file, attrs, err);
+
+		__on_api_error_ex("DeleteFile", ERROR_ACCESS_DENIED, file);
+		return false;
+	}
+
+	bool delete_folder(const wstring & folder, dword attrs, api_error_cb * err)
+	{
+		return sim->delete_folder(folder, attrs, err);
+	}
+};
+
+/*
+ *	Transient failures are retried until they go through, both for
+ *	files and for folders. fs_sim rolls the dice anew on each attempt
+ *	at the same item.
+ */
+static
+bool check_retries()
+{
+	for (int staged = 0; staged < 2; staged++)
+	{
+		sim_check x(3, 6, 20);
+
+		x.sim.profile.error_ppm = 200*1000;
+		x.conf.retries = 8;
+		x.conf.retry_msecs = 1;
+
+		__check( x.run(staged > 0) );
+		__check( x.info.done && ! x.errors );
+		__check( x.info.r_queued && x.info.r_ok && ! x.info.r_failed );
+		__check( x.info.d_deleted == x.folders );
+		__check( x.info.f_deleted == x.files );
+		__check( x.all_gone() );
+	}
+
+	// a folder left non-empty by a failed file isn't retried, and
+	// neither is any of the folders above it
+	{
+		sim_check x(4, 2, 3);
+		denier d;
+
+		d.sim = &x.sim;
+		d.deny = x.root.self.name + L"\\folder-0001\\folder-0000\\folder-0001\\folder-0000\\file-00002.tmp";
+
+		x.conf.fs = &d;
+		x.conf.retries = 8;
+		x.conf.retry_msecs = 1000;
+
+		__check( x.run(false) );
+		__check( x.info.done && x.errors == 1 + 4 + 1 ); // the file, its folders, the root
+		__check( ! x.info.r_queued && ! x.info.r_failed );
+		__check( x.info.f_deleted == x.files - 1 );
+	}
+
+	// and reported as they are if not retried
+	{
+		sim_check x(3, 6, 20);
+
+		x.sim.profile.error_ppm = 200*1000;
+		x.conf.retries = 0;
+
+		__check( x.run(false) );
+		__check( x.errors && ! x.info.r_queued );
+		__check( x.info.f_deleted < x.files );
+	}
+
+	return true;
+}
+
+/*
+ *	A scan saved to a snapshot and loaded back is the same tree,
+ *	and a damaged snapshot is rejected rather than half-loaded.
+ */
+static
+bool same_tree(const folder & a, const folder & b)
+{
+	vector< pair<const folder *, const folder *> > todo;
+
+	todo.push_back( make_pair(&a, &b) );
+
+	while (todo.size())
+	{
+		const folder * x = todo.back().first;
+		const folder * y = todo.back().second;
+
+		todo.pop_back();
+
+		if (x->self.name != y->self.name ||
+		    x->self.info.attrs != y->self.info.attrs ||
+		    x->items != y->items ||
+		    x->folders.size() != y->folders.size() ||
+		    x->files.names != y->files.names ||
+		    x->files.name_end != y->files.name_end ||
+		    x->files.attrs != y->files.attrs ||
+		    x->files.bytes != y->files.bytes)
+			return false;
+
+		for (size_t i = 0; i < x->folders.size(); i++)
+			todo.push_back( make_pair(x->folders[i], y->folders[i]) );
+	}
+
+	return true;
+}
+
+static
+bool check_snapshot()
+{
+	sim_check        x(3, 5, 30);
+	folder           loaded, broken;
+	snapshot_info    si;
+	api_error_trace  err;
+	wchar_t          temp[MAX_PATH];
+	wstring          file;
+	LARGE_INTEGER    half;
+	HANDLE           h;
+
+	__check( GetTempPath(MAX_PATH, temp) );
+	file = wstring(temp) + L"byenow-self-check.snap";
+
+	__check( ultra_mach_scan(x.root, x.conf, &x) );
+	__check( save_snapshot(file, x.root, &err) );
+
+	__check( load_snapshot(file, loaded, si, &err) );
+	__check( si.folders == x.folders && si.files == x.files );
+	__check( same_tree(x.root, loaded) );
+
+	// what was loaded is good for deleting
+	__check( ultra_mach_delete(loaded, true, x.conf, &x) );
+	__check( ! x.errors && x.sim.root->kids.empty() );
+
+	// cut short
+	h = CreateFile(file.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	__check( h != INVALID_HANDLE_VALUE );
+
+	__check( GetFileSizeEx(h, &half) );
+	half.QuadPart /= 2;
+
+	__check( SetFilePointerEx(h, half, NULL, FILE_BEGIN) && SetEndOfFile(h) );
+	CloseHandle(h);
+
+	__check( ! load_snapshot(file, broken, si, &err) );
+
+	DeleteFile(file.c_str());
+	return true;
+}
+
+/*
+ *	An interrupted run resumed from its journal and the original
+ *	scan, the way --journal and --load-scan go together.
+ */
+static
+bool check_journal()
+{
+	sim_check x(3, 6, 10);
+	folder   snap;
+	journal  j1, j2, j3;
+	wchar_t  temp[MAX_PATH];
+	wstring  file;
+	size_t   dropped;
+
+	__check( GetTempPath(MAX_PATH, temp) );
+	file = wstring(temp) + L"byenow-self-check.jrnl";
+	DeleteFile(file.c_str());
+
+	snap.self = x.root.self;
+	__check( ultra_mach_scan(snap, x.conf, &x) );
+
+	// first go, cut short
+	__check( j1.load(file, "one") && j1.done.empty() );
+	__check( j1.open(file, "one") );
+
+	x.conf.jrnl = &j1;
+	x.stop_at = x.files / 2;
+
+	__check( ! x.run(true) );
+	__check( x.info.d_deleted && x.info.d_deleted < x.folders );
+	j1.close();
+
+	// not this one's journal
+	__check( ! j2.load(file, "two") && j2.stale );
+
+	// second go
+	__check( j3.load(file, "one") );
+	// folders whose ph3 was already running when cancelled still
+	// get journaled, but may miss the last tick
+	__check( j3.done.size() >= x.info.d_deleted );
+
+	dropped = j3.prune(snap);
+	__check( dropped && dropped <= j3.done.size() );
+
+	x.conf.jrnl = NULL;
+	x.stop_at = -1;
+	x.errors = 0;
+
+	__check( ultra_mach_delete(snap, true, x.conf, &x) );
+	__check( ! x.errors && x.sim.root->kids.empty() );
+
+	__check( j3.discard() );
+	__check( GetFileAttributes(file.c_str()) == INVALID_FILE_ATTRIBUTES );
+	return true;
+}
+
+/*
+ *	folder_pool holds on to its slabs while any folder is live,
+ *	and lets go of all of them once none are
+ */
+static
+bool check_folder_pool()
+{
+	vector<folder *> live;
+
+	// nothing is left over from the checks before this one
+	__check( folder_pool::trim() );
+
+	for (size_t round = 0; round < 3; round++)
+	{
+		for (size_t i = 0; i < 3*4096; i++)
+			live.push_back(new folder);
+
+		__check( folder_pool::slabs() >= 3 );
+
+		for (size_t i = 1; i < live.size(); i++)
+			delete live[i];
+
+		__check( ! folder_pool::trim() );
+
+		delete live[0];
+		live.clear();
+
+		__check( folder_pool::trim() );
+		__check( folder_pool::slabs() == 0 );
+	}
+
+	return true;
+}
+
+/*
+ *	fs_sim, with several threads deleting the same files at once
+ */
+struct racer : api_error_cb
+{
+	fs_sim          * sim;
+	vector<wstring> * files;
+	size_t            failed;
+
+	void on_api_error_x(const api_error & e) { failed++; }
+
+	static dword __stdcall thread_proc(void * arg)
+	{
+		racer * r = (racer *)arg;
+
+		for (auto & f : *r->files)
+			if (! r->sim->delete_file(f, 0, r))
+				r->failed++;
+
+		return 0;
+	}
+};
+
+static
+bool check_fs_sim()
+{
+	sim_check x(0, 0, 10*1000);
+	vector<wstring> files;
+	racer r[4];
+	HANDLE t[4];
+
+	for (auto & kv : x.sim.root->kids)
+		files.push_back(x.root.self.name + L'\\' + kv.second->name);
+
+	for (size_t i = 0; i < 4; i++)
+	{
+		r[i].sim = &x.sim;
+		r[i].files = &files;
+		r[i].failed = 0;
+
+		t[i] = CreateThread(NULL, 0, racer::thread_proc, &r[i], 0, NULL);
+		__check( t[i] );
+	}
+
+	__check( WaitForMultipleObjects(4, t, TRUE, 60*1000) == WAIT_OBJECT_0 );
+
+	for (size_t i = 0; i < 4; i++)
+	{
+		CloseHandle(t[i]);
+		__check( r[i].failed == 0 );
+	}
+
+	__check( x.all_gone() );
+	return true;
+}
+
+/*
+ *
+ */
+typedef bool (* check_func)();
+
+struct check_entry
+{
+	const char * name;
+	check_func   func;
+};
+
+static const check_entry checks[] =
+{
+	{ "steal_queue",   check_steal_queue   },
+	{ "tuner",         check_tuner         },
+	{ "fs_sim",        check_fs_sim        },
+	{ "completion",    check_completion    },
+	{ "cancel",        check_cancel        },
+	{ "retries",       check_retries       },
+	{ "snapshot",      check_snapshot      },
+	{ "journal",       check_journal       },
+	{ "folder_pool",   check_folder_pool   },
+};
+
+bool run_self_checks(const string & only)
+{
+	size_t ran = 0, failed = 0;
+
+	printf("Self-checks:\n");
+
+	for (auto & c : checks)
+	{
+		if (only.size() && only != c.name)
+			continue;
+
+		current = c.name;
+
+		if (c.func()) printf("  %-16s ok\n", c.name);
+		else          failed++;
+
+		ran++;
+	}
+
+	printf("%zu of %zu passed\n", ran - failed, ran);
+
+	return ran && ! failed;
+}
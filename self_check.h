@@ -0,0 +1,25 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#ifndef _ULTRA_SELF_CHECK_H_
+#define _ULTRA_SELF_CHECK_H_
+
+#include "libp/types.h"
+
+/*
+ *	Built-in checks of the scheduling machinery, run with the
+ *	hidden --self-check option. Anything that touches files is
+ *	run against fs_sim, so these need no scratch volume.
+ *
+ *	'only' picks the checks by name, empty runs all of them.
+ */
+bool run_self_checks(const string & only);
+
+#endif
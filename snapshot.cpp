@@ -0,0 +1,382 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#include "snapshot.h"
+
+#include "libp/enforce.h"
+#include "libp/_elpify.h"
+
+//
+static const char snap_magic[8] = { 'b', 'y', 'e', 'n', 'o', 'w', 0x1a, 1 };
+
+struct snap_header
+{
+	char      magic[8];
+	uint64_t  folders;
+	uint64_t  files;
+	uint64_t  chars;     // in the name pool
+};
+
+struct snap_folder
+{
+	uint64_t  parent;    // index, -1 for the root
+	uint64_t  name;      // offset in the name pool
+	uint32_t  name_len;
+	uint32_t  attrs;
+	uint64_t  files;     // count, these follow the previous folder's
+};
+
+struct snap_file
+{
+	uint64_t  name;
+	uint32_t  name_len;
+	uint32_t  attrs;
+	uint64_t  bytes;
+};
+
+typedef vector< pair<const folder *, uint64_t> > snap_list; // folder, parent index
+
+//
+struct snap_writer
+{
+	const wstring & file;
+	api_error_cb  * err;
+	HANDLE          h;
+	vector<char>    buf;
+
+	snap_writer(const wstring & _file, api_error_cb * _err) : file(_file)
+	{
+		err = _err;
+		h = INVALID_HANDLE_VALUE;
+		buf.reserve(1024*1024);
+	}
+
+	~snap_writer()
+	{
+		if (h != INVALID_HANDLE_VALUE)
+			CloseHandle(h);
+	}
+
+	bool open()
+	{
+		h = elp->CreateFile(file.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (h != INVALID_HANDLE_VALUE)
+			return true;
+
+		__on_api_error("CreateFile", file);
+		return false;
+	}
+
+	bool put(const void * data, size_t bytes)
+	{
+		if (buf.size() + bytes > buf.capacity() && ! flush())
+			return false;
+
+		if (bytes > buf.capacity())
+			return write(data, bytes);
+
+		buf.insert(buf.end(), (const char *)data, (const char *)data + bytes);
+		return true;
+	}
+
+	bool flush()
+	{
+		bool ok = write(buf.data(), buf.size());
+		buf.clear();
+		return ok;
+	}
+
+	bool write(const void * data, size_t bytes)
+	{
+		const char * ptr = (const char *)data;
+		dword n;
+
+		for ( ; bytes; ptr += n, bytes -= n)
+		{
+			if (! WriteFile(h, ptr, (dword)min<size_t>(bytes, 64*1024*1024), &n, NULL))
+			{
+				__on_api_error("WriteFile", file);
+				return false;
+			}
+		}
+
+		return true;
+	}
+};
+
+/*
+ *
+ */
+bool save_snapshot(const wstring & file, const folder & root, api_error_cb * err)
+{
+	snap_writer  out(file, err);
+	snap_header  hdr = { };
+	snap_list    list, todo;
+	uint64_t     name = 0;
+
+	// pre-order, iteratively
+	todo.push_back( make_pair(&root, -1) );
+
+	while (todo.size())
+	{
+		auto item = todo.back();
+		const folder * x = item.first;
+
+		todo.pop_back();
+
+		hdr.folders++;
+		hdr.files += x->files.size();
+		hdr.chars += x->self.name.size() + x->files.names.size();
+
+		for (size_t i = x->folders.size(); i-- > 0; )
+			if (x->folders[i]) // NULL if already deleted
+				todo.push_back( make_pair(x->folders[i], list.size()) );
+
+		list.push_back(item);
+	}
+
+	memcpy(hdr.magic, snap_magic, sizeof hdr.magic);
+
+	if (! out.open() ||
+	    ! out.put(&hdr, sizeof hdr))
+		return false;
+
+	// names are pooled in the order of folder, its files, next folder,
+	// so each folder's file names can be loaded with a single copy
+
+	for (auto & item : list)
+	{
+		const folder * x = item.first;
+		snap_folder    rec;
+
+		rec.parent = item.second;
+		rec.name = name;
+		rec.name_len = (uint32_t)x->self.name.size();
+		rec.attrs = x->self.info.attrs;
+		rec.files = x->files.size();
+
+		name += rec.name_len + x->files.names.size();
+
+		if (! out.put(&rec, sizeof rec))
+			return false;
+	}
+
+	name = 0;
+
+	for (auto & item : list)
+	{
+		const folder * x = item.first;
+
+		name += x->self.name.size();
+
+		for (size_t i = 0; i < x->files.size(); i++)
+		{
+			snap_file rec;
+
+			rec.name = name + x->files.name_pos(i);
+			rec.name_len = (uint32_t)x->files.name_len(i);
+			rec.attrs = x->files.attrs[i];
+			rec.bytes = x->files.get_bytes(i);
+
+			if (! out.put(&rec, sizeof rec))
+				return false;
+		}
+
+		name += x->files.names.size();
+	}
+
+	for (auto & item : list)
+	{
+		const folder * x = item.first;
+
+		if (! out.put(x->self.name.data(), x->self.name.size() * sizeof(wchar_t)) ||
+		    ! out.put(x->files.names.data(), x->files.names.size() * sizeof(wchar_t)))
+			return false;
+	}
+
+	return out.flush();
+}
+
+/*
+ *
+ */
+static
+bool load_files(const snap_file * file, size_t count, const wchar_t * pool, uint64_t chars, folder * x)
+{
+	file_list & list = x->files;
+	uint64_t lo, hi;
+
+	if (! count)
+		return true;
+
+	// names of a folder's files are contiguous, and in order
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const snap_file & r = file[i];
+
+		if (r.name > chars || r.name_len > chars - r.name ||
+		    i && r.name != file[i-1].name + file[i-1].name_len)
+			return false;
+	}
+
+	lo = file[0].name;
+	hi = file[count-1].name + file[count-1].name_len;
+
+	if (hi - lo >= UINT32_MAX)
+		return false;
+
+	list.names.assign(pool + lo, (size_t)(hi - lo));
+	list.name_end.resize(count);
+	list.attrs.resize(count);
+	list.bytes.resize(count);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		list.name_end[i] = (uint32_t)(file[i].name + file[i].name_len - lo);
+		list.attrs[i] = file[i].attrs;
+		list.bytes[i] = file[i].bytes;
+	}
+
+	return true;
+}
+
+static
+bool load_records(const char * data, uint64_t size, folder & root, snapshot_info & info)
+{
+	const snap_header * hdr = (const snap_header *)data;
+	const snap_folder * dir;
+	const snap_file   * file;
+	const wchar_t     * pool;
+	vector<folder *>    nodes;
+	uint64_t            next = 0;
+
+	if (size < sizeof *hdr || memcmp(hdr->magic, snap_magic, sizeof snap_magic))
+		return false;
+
+	size -= sizeof *hdr;
+
+	if (! hdr->folders ||
+	    hdr->folders > size / sizeof *dir ||
+	    hdr->files   > (size - hdr->folders * sizeof *dir) / sizeof *file ||
+	    hdr->chars  != (size - hdr->folders * sizeof *dir - hdr->files * sizeof *file) / sizeof *pool)
+		return false;
+
+	dir  = (const snap_folder *)(hdr + 1);
+	file = (const snap_file *)(dir + hdr->folders);
+	pool = (const wchar_t *)(file + hdr->files);
+
+	nodes.reserve(hdr->folders);
+
+	for (uint64_t i = 0; i < hdr->folders; i++)
+	{
+		const snap_folder & rec = dir[i];
+		folder * x;
+
+		if (rec.name > hdr->chars || rec.name_len > hdr->chars - rec.name ||
+		    rec.files > hdr->files - next)
+			return false;
+
+		if (i == 0)
+		{
+			if (rec.parent != -1)
+				return false;
+
+			x = &root;
+		}
+		else
+		{
+			if (rec.parent >= i)
+				return false;
+
+			x = new folder();
+			x->parent = nodes[rec.parent];
+			x->index = x->parent->folders.size();
+
+			x->parent->folders.push_back(x);
+			x->parent->items++;
+		}
+
+		x->self.name.assign(pool + rec.name, rec.name_len);
+		x->self.info.attrs = rec.attrs;
+		x->self.info.bytes = 0;
+
+		if (! load_files(file + next, (size_t)rec.files, pool, hdr->chars, x))
+			return false;
+
+		for (auto & b : x->files.bytes)
+			info.bytes += b;
+
+		x->items += (uint32_t)rec.files;
+		next += rec.files;
+
+		nodes.push_back(x);
+	}
+
+	info.folders = (size_t)hdr->folders;
+	info.files = (size_t)hdr->files;
+
+	return next == hdr->files;
+}
+
+bool load_snapshot(const wstring & file, folder & root, snapshot_info & info, api_error_cb * err)
+{
+	HANDLE         h, m = NULL;
+	LARGE_INTEGER  size;
+	const char   * view = NULL;
+	bool           ok = false;
+
+	__enforce(root.folders.empty() && root.files.empty());
+
+	memset(&info, 0, sizeof info);
+
+	h = elp->CreateFile(file.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+	{
+		__on_api_error("CreateFile", file);
+		return false;
+	}
+
+	if (! GetFileSizeEx(h, &size))
+	{
+		__on_api_error("GetFileSizeEx", file);
+		goto out;
+	}
+
+	if (size.QuadPart < sizeof(snap_header))
+	{
+		__on_api_error_ex("LoadSnapshot", ERROR_BAD_FORMAT, file);
+		goto out;
+	}
+
+	m = CreateFileMappingW(h, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (! m)
+	{
+		__on_api_error("CreateFileMapping", file);
+		goto out;
+	}
+
+	view = (const char *)MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+	if (! view)
+	{
+		__on_api_error("MapViewOfFile", file);
+		goto out;
+	}
+
+	ok = load_records(view, size.QuadPart, root, info);
+	if (! ok)
+		__on_api_error_ex("LoadSnapshot", ERROR_BAD_FORMAT, file);
+
+out:
+	if (view) UnmapViewOfFile(view);
+	if (m) CloseHandle(m);
+	CloseHandle(h);
+	return ok;
+}
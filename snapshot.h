@@ -0,0 +1,37 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#ifndef _ULTRA_SNAPSHOT_H_
+#define _ULTRA_SNAPSHOT_H_
+
+#include "folder.h"
+
+/*
+ *	Scan results saved to a file, so that they can be deleted
+ *	later without rescanning.
+ *
+ *	The file is a header followed by fixed-size folder records in
+ *	pre-order, then file records grouped by folder, then a pool
+ *	of UTF-16 names. Everything is referenced by index or offset,
+ *	so the file is loaded by mapping it and walking the records
+ *	once, without any parsing.
+ */
+struct snapshot_info
+{
+	size_t    folders;
+	size_t    files;
+	uint64_t  bytes;
+};
+
+bool save_snapshot(const wstring & file, const folder & root, api_error_cb * err);
+
+bool load_snapshot(const wstring & file, folder & root, snapshot_info & info, api_error_cb * err);
+
+#endif
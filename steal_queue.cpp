@@ -0,0 +1,301 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#include "steal_queue.h"
+
+#include "libp/enforce.h"
+#include "libp/atomic.h"
+
+//
+static thread_local steal_queue::worker * tls_worker = NULL;
+
+//
+steal_queue::steal_queue()
+{
+	levels = 1;
+	lifo = true;
+
+	queued = 0;
+	sleepers = 0;
+	next = 0;
+	active = 0;
+	stop = false;
+
+	InitializeSRWLock(&idle_lock);
+	InitializeConditionVariable(&idle_cv);
+	InitializeConditionVariable(&park_cv);
+}
+
+steal_queue::~steal_queue()
+{
+	work_item_vec out;
+
+	cancel(out);
+	__enforce(out.empty()); // owner should've called cancel()
+}
+
+//
+bool steal_queue::init(size_t threads, size_t _levels, bool _lifo)
+{
+	__enforce(workers.empty() && threads && _levels);
+
+	levels = _levels;
+	lifo = _lifo;
+	active = threads;
+
+	for (size_t i = 0; i < threads; i++)
+	{
+		worker * w = new worker();
+
+		w->queue = this;
+		w->index = i;
+		w->thread = NULL;
+		w->items.resize(levels);
+		w->count = 0;
+		InitializeSRWLock(&w->lock);
+
+		workers.push_back(w);
+	}
+
+	for (auto & w : workers)
+	{
+		w->thread = CreateThread(NULL, 0, thread_proc, w, 0, NULL);
+		if (! w->thread)
+			return false;
+	}
+
+	return true;
+}
+
+//
+void steal_queue::enqueue(work_item * wi, size_t level)
+{
+	worker * w = tls_worker;
+
+	__enforce(level < levels);
+
+	if (! w || w->queue != this)
+		w = workers[ atomic_inc(&next) % active ];
+
+	AcquireSRWLockExclusive(&w->lock);
+	w->items[level].push_back(wi);
+	w->count++;
+	ReleaseSRWLockExclusive(&w->lock);
+
+	atomic_inc(&queued);
+
+	if (sleepers)
+	{
+		AcquireSRWLockExclusive(&idle_lock);
+		WakeConditionVariable(&idle_cv);
+		ReleaseSRWLockExclusive(&idle_lock);
+	}
+}
+
+void steal_queue::halt()
+{
+	AcquireSRWLockExclusive(&idle_lock);
+	stop = true;
+	WakeAllConditionVariable(&idle_cv);
+	WakeAllConditionVariable(&park_cv);
+	ReleaseSRWLockExclusive(&idle_lock);
+}
+
+void steal_queue::join()
+{
+	for (auto & w : workers)
+	{
+		if (! w->thread)
+			continue;
+
+		WaitForSingleObject(w->thread, INFINITE);
+		CloseHandle(w->thread);
+		w->thread = NULL;
+	}
+}
+
+void steal_queue::cancel(work_item_vec & out)
+{
+	halt();
+	join();
+
+	for (auto & w : workers)
+	{
+		for (auto & deq : w->items)
+			for (auto & wi : deq)
+				out.push_back(wi);
+
+		delete w;
+	}
+
+	workers.clear();
+	queued = 0;
+}
+
+void steal_queue::set_active(size_t n)
+{
+	n = min(max<size_t>(n, 1), workers.size());
+
+	if (n == active)
+		return;
+
+	// sleepers past the new 'active' are woken too, to go park,
+	// or else enqueue() may end up waking one of them instead of
+	// a worker that would actually take the item
+
+	AcquireSRWLockExclusive(&idle_lock);
+	active = n;
+	WakeAllConditionVariable(&idle_cv);
+	WakeAllConditionVariable(&park_cv);
+	ReleaseSRWLockExclusive(&idle_lock);
+}
+
+//
+bool steal_queue::pop(worker * w, bool back, work_item * & wi)
+{
+	// w->lock is held
+
+	for (size_t i = levels; i-- > 0; )
+	{
+		worker::item_deq & deq = w->items[i];
+
+		if (deq.empty())
+			continue;
+
+		if (back) { wi = deq.back();  deq.pop_back();  }
+		else      { wi = deq.front(); deq.pop_front(); }
+
+		w->count--;
+		return true;
+	}
+
+	return false;
+}
+
+bool steal_queue::pop_local(worker * w, work_item * & wi)
+{
+	bool ok;
+
+	if (! w->count)
+		return false;
+
+	AcquireSRWLockExclusive(&w->lock);
+	ok = pop(w, lifo, wi);
+	ReleaseSRWLockExclusive(&w->lock);
+
+	return ok;
+}
+
+bool steal_queue::steal(worker * w, work_item * & wi)
+{
+	size_t n = workers.size();
+
+	for (size_t i = 1; i < n; i++)
+	{
+		worker * peer = workers[ (w->index + i) % n ];
+
+		if (! peer->count) // racy peek, but it's just a hint
+			continue;
+
+		if (! TryAcquireSRWLockExclusive(&peer->lock))
+			continue;
+
+		bool ok = pop(peer, false, wi);
+
+		ReleaseSRWLockExclusive(&peer->lock);
+
+		if (ok)
+			return true;
+	}
+
+	return false;
+}
+
+bool steal_queue::wait_for_work()
+{
+	AcquireSRWLockExclusive(&idle_lock);
+
+	atomic_inc(&sleepers);
+
+	while (! queued && ! stop)
+		SleepConditionVariableSRW(&idle_cv, &idle_lock, INFINITE, 0);
+
+	atomic_dec(&sleepers);
+
+	ReleaseSRWLockExclusive(&idle_lock);
+
+	return ! stop;
+}
+
+bool steal_queue::park(worker * w)
+{
+	AcquireSRWLockExclusive(&idle_lock);
+
+	// if woken for an item, pass the wake on to someone active
+	if (queued)
+		WakeConditionVariable(&idle_cv);
+
+	while (w->index >= active && ! stop)
+		SleepConditionVariableSRW(&park_cv, &idle_lock, INFINITE, 0);
+
+	ReleaseSRWLockExclusive(&idle_lock);
+
+	return ! stop;
+}
+
+//
+void steal_queue::run(worker * w)
+{
+	work_item * wi;
+
+	tls_worker = w;
+
+	while (! stop)
+	{
+		if (w->index >= active)
+		{
+			if (! park(w))
+				break;
+
+			continue;
+		}
+
+		if (! pop_local(w, wi) &&
+		    ! steal(w, wi))
+		{
+			// 'queued' may be non-zero if a peer was locked
+			// at the time of stealing, so just spin around
+			if (queued)
+			{
+				SwitchToThread();
+				continue;
+			}
+
+			if (! wait_for_work())
+				break;
+
+			continue;
+		}
+
+		atomic_dec(&queued);
+
+		wi->execute(); // may recycle 'wi'
+	}
+
+	tls_worker = NULL;
+}
+
+dword __stdcall steal_queue::thread_proc(void * arg)
+{
+	worker * w = (worker *)arg;
+
+	w->queue->run(w);
+	return 0;
+}
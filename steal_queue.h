@@ -0,0 +1,95 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#ifndef _ULTRA_STEAL_QUEUE_H_
+#define _ULTRA_STEAL_QUEUE_H_
+
+#include "libp/types.h"
+#include "libp/_windows.h"
+#include "libp/_simple_work_queue.h" // work_item
+
+/*
+ *	A replacement for simple_work_queue that gives each worker its
+ *	own deque instead of having all of them contend for a single
+ *	shared one.
+ *
+ *	Items enqueued from a worker thread go to that worker's deque.
+ *	Items enqueued from elsewhere are spread round-robin. Workers
+ *	pick up their own items either LIFO or FIFO, and idle workers
+ *	steal FIFO from their peers.
+ *
+ *	Each deque is split into 'levels'. Higher levels are always
+ *	drained first, both locally and when stealing.
+ *
+ *	Only the first 'active' workers run, the rest are parked. The
+ *	items left in the deques of parked workers are stolen by the
+ *	active ones.
+ *
+ *	Executed items are not collected - work_item::execute() is
+ *	expected to dispose of its item, and it may do so before it
+ *	returns.
+ */
+struct steal_queue
+{
+	steal_queue();
+	~steal_queue();
+
+	__no_copying(steal_queue);
+
+	//
+	bool init(size_t threads, size_t levels, bool lifo);
+
+	void enqueue(work_item * wi, size_t level);
+	void halt();                       // stop workers, don't wait
+	void join();                       // wait for halted workers
+	void cancel(work_item_vec & out);  // halt, wait, return leftovers
+
+	void set_active(size_t n);
+
+	//
+	struct worker
+	{
+		typedef deque<work_item *> item_deq;
+
+		steal_queue       * queue;
+		size_t              index;
+		HANDLE              thread;
+
+		SRWLOCK             lock;
+		vector<item_deq>    items;      // by level
+		volatile size_t     count;      // in all levels
+	};
+
+	bool pop(worker * w, bool back, work_item * & wi);
+	bool pop_local(worker * w, work_item * & wi);
+	bool steal(worker * w, work_item * & wi);
+	bool wait_for_work();
+	bool park(worker * w);
+
+	void run(worker * w);
+	static dword __stdcall thread_proc(void * arg);
+
+	//
+	vector<worker *>    workers;
+	size_t              levels;
+	bool                lifo;
+
+	volatile size_t     queued;     // in all deques
+	volatile size_t     sleepers;
+	volatile size_t     next;       // round-robin for external enqueues
+	volatile size_t     active;
+	volatile bool       stop;
+
+	SRWLOCK             idle_lock;
+	CONDITION_VARIABLE  idle_cv;
+	CONDITION_VARIABLE  park_cv;
+};
+
+#endif
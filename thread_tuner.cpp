@@ -0,0 +1,132 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#include "thread_tuner.h"
+
+#include "libp/enforce.h"
+
+//
+thread_tuner::thread_tuner()
+{
+	lo = hi = curr = 1;
+	dir = +1;
+
+	period.raw = 500*1000;
+	hold = 6;
+	noise = 0.05;
+
+	last_time.raw = 0;
+	last_ops = 0;
+	last_rate = 0;
+	holding = 0;
+	probe = -1;
+}
+
+void thread_tuner::init(size_t _lo, size_t _hi, size_t initial)
+{
+	__enforce(_lo && _lo <= _hi);
+
+	lo = _lo;
+	hi = _hi;
+	curr = min(max(initial, lo), hi);
+	dir = +1;
+
+	last_time.raw = 0;
+	last_rate = 0;
+	holding = 0;
+	probe = -1;
+}
+
+//
+size_t thread_tuner::tick(uint64_t ops, usec_t now)
+{
+	double rate;
+
+	if (! last_time.raw)
+	{
+		last_time = now;
+		last_ops = ops;
+		return curr;
+	}
+
+	if (now - last_time < period)
+		return curr;
+
+	if (ops == last_ops)
+	{
+		// idle, nothing to go by
+		last_time = now;
+		return curr;
+	}
+
+	rate = (ops - last_ops) * 1000000. / (now - last_time);
+
+	last_time = now;
+	last_ops = ops;
+
+	if (! last_rate)
+	{
+		// first sample, try going up
+		last_rate = rate;
+		move(+1);
+		return curr;
+	}
+
+	if (holding)
+	{
+		// the last move is judged against the rate at the same
+		// count, so once the hold is over, make a fresh one
+		if (! --holding)
+		{
+			move(probe);
+			probe = -probe;
+		}
+
+		last_rate = rate;
+		return curr;
+	}
+
+	if (rate > last_rate * (1 + noise))
+	{
+		// better - keep going
+		move(dir);
+	}
+	else
+	if (rate < last_rate * (1 - noise) || dir > 0)
+	{
+		// worse, or more threads didn't help - step back
+		move(-dir);
+		holding = hold;
+	}
+	else
+	{
+		// fewer threads didn't hurt - keep shedding them
+		move(-1);
+	}
+
+	last_rate = rate;
+	return curr;
+}
+
+//
+size_t thread_tuner::step() const
+{
+	return max<size_t>(1, curr / 4);
+}
+
+void thread_tuner::move(int towards)
+{
+	size_t delta = step();
+
+	dir = towards;
+
+	if (towards > 0) curr = min(curr + delta, hi);
+	else             curr = (curr > lo + delta) ? curr - delta : lo;
+}
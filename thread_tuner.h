@@ -0,0 +1,57 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#ifndef _ULTRA_THREAD_TUNER_H_
+#define _ULTRA_THREAD_TUNER_H_
+
+#include "libp/types.h"
+#include "libp/time.h"
+
+/*
+ *	Hill-climbing controller for the number of active workers.
+ *
+ *	It is fed a running count of completed operations and every
+ *	'period' it compares the throughput with that of the previous
+ *	period. If the last change in the thread count helped, it is
+ *	repeated, if it hurt, it is undone. If it made no difference,
+ *	the tuner leans towards fewer threads, i.e. it looks for the
+ *	knee of the throughput curve rather than for its plateau.
+ *
+ *	After backing off it holds the count for a few periods, then
+ *	probes again in case the workload has changed, alternating
+ *	between probing down and up.
+ */
+struct thread_tuner
+{
+	size_t    lo, hi;       // bounds
+	size_t    curr;         // current thread count
+	int       dir;          // +1 or -1, direction of the last move
+
+	usec_t    period;
+	size_t    hold;         // periods to hold the count after a back-off
+	double    noise;        // relative throughput change deemed as noise
+
+	usec_t    last_time;
+	uint64_t  last_ops;
+	double    last_rate;    // ops per second
+	size_t    holding;
+	int       probe;        // direction of the next probe
+
+	//
+	thread_tuner();
+
+	void init(size_t lo, size_t hi, size_t initial);
+	size_t tick(uint64_t ops, usec_t now);
+
+	size_t step() const;
+	void move(int towards);
+};
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#include "tracer.h"
+
+#include "libp/string_utils.h"
+
+//
+static thread_local tracer::buffer * tls_buffer = NULL;
+
+static const char * phase_names[] = { "?", "scan", "delete files", "delete folder" };
+
+//
+static
+string json_escape(const string & str)
+{
+	string r;
+
+	for (auto c : str)
+	{
+		if (c == '"' || c == '\\')
+		{
+			r += '\\';
+			r += c;
+		}
+		else
+		if ((unsigned char)c < 0x20)
+		{
+			r += stringf("\\u%04x", c);
+		}
+		else
+		{
+			r += c;
+		}
+	}
+
+	return r;
+}
+
+//
+tracer::tracer()
+{
+	epoch = usec();
+	InitializeSRWLock(&lock);
+}
+
+tracer::~tracer()
+{
+	for (auto & b : buffers)
+		delete b;
+}
+
+//
+bool tracer::init(const wstring & _file)
+{
+	FILE * fh;
+
+	file = _file;
+	epoch = usec();
+
+	// fail early rather than after the run
+	fh = _wfopen(file.c_str(), L"wb");
+	if (! fh)
+		return false;
+
+	fclose(fh);
+	return true;
+}
+
+bool tracer::save()
+{
+	FILE * fh;
+	bool   first = true;
+
+	fh = _wfopen(file.c_str(), L"wb");
+	if (! fh)
+		return false;
+
+	fprintf(fh, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	for (auto & b : buffers)
+	{
+		fprintf(fh, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"worker %lu\"}}",
+			first ? "" : ",\n", b->tid, b->tid);
+
+		first = false;
+
+		for (auto & e : b->events)
+		{
+			string path = to_utf8( b->names.substr(e.name_pos, e.name_len) );
+
+			fprintf(fh, ",\n{\"name\":\"%s\",\"cat\":\"ph%d\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,"
+			            "\"ts\":%I64u,\"dur\":%I64u,\"args\":{\"path\":\"%s\",\"items\":%zu}}",
+				phase_names[e.phase], e.phase, b->tid,
+				(uint64_t)(e.started - epoch), e.usecs,
+				json_escape(path).c_str(), e.items);
+		}
+	}
+
+	fprintf(fh, "\n]}\n");
+
+	return (fclose(fh) == 0);
+}
+
+//
+void tracer::add(int phase, const wstring & path, size_t items, usec_t started, usec_t finished)
+{
+	buffer * b = get_buffer();
+	event    e;
+
+	e.started  = started;
+	e.usecs    = finished - started;
+	e.phase    = (phase >= 1 && phase <= 3) ? phase : 0;
+	e.items    = items;
+	e.name_pos = b->names.size();
+	e.name_len = path.size();
+
+	b->names += path;
+	b->events.push_back(e);
+}
+
+tracer::buffer * tracer::get_buffer()
+{
+	buffer * b = tls_buffer;
+
+	if (b && b->owner == this)
+		return b;
+
+	b = new buffer();
+	b->owner = this;
+	b->tid = GetCurrentThreadId();
+
+	AcquireSRWLockExclusive(&lock);
+	buffers.push_back(b);
+	ReleaseSRWLockExclusive(&lock);
+
+	return tls_buffer = b;
+}
@@ -0,0 +1,66 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#ifndef _ULTRA_TRACER_H_
+#define _ULTRA_TRACER_H_
+
+#include "libp/types.h"
+#include "libp/time.h"
+#include "libp/_windows.h"
+
+/*
+ *	Timeline of ultra_task executions, saved in Chrome's trace
+ *	event format (chrome://tracing, Perfetto, Speedscope).
+ *
+ *	Each thread appends to its own buffer, and nothing is written
+ *	out until save(), so tracing doesn't disturb the run much.
+ */
+struct tracer
+{
+	struct event
+	{
+		usec_t    started;
+		uint64_t  usecs;
+		int       phase;
+		size_t    items;
+		size_t    name_pos;  // in buffer::names
+		size_t    name_len;
+	};
+
+	struct buffer
+	{
+		tracer        * owner;
+		dword           tid;
+		vector<event>   events;
+		wstring         names;
+	};
+
+	//
+	tracer();
+	~tracer();
+
+	__no_copying(tracer);
+
+	bool init(const wstring & file);
+	bool save();
+
+	void add(int phase, const wstring & path, size_t items, usec_t started, usec_t finished);
+
+	buffer * get_buffer(); // of the calling thread
+
+	//
+	wstring           file;
+	usec_t            epoch;
+
+	SRWLOCK           lock;
+	vector<buffer *>  buffers;
+};
+
+#endif
@@ -0,0 +1,298 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#include "tree_gen.h"
+
+#include "libp/enforce.h"
+#include "libp/string_utils.h"
+#include "libp/_elpify.h"
+
+//
+static const wchar_t * shapes[] = { L"deep", L"wide", L"node_modules", L"tiny", L"huge", L"dirs" };
+
+bool is_tree_shape(const wstring & shape)
+{
+	for (auto & name : shapes)
+		if (shape == name)
+			return true;
+
+	return false;
+}
+
+/*
+ *	tree_sink_disk
+ */
+tree_sink_disk::tree_sink_disk(api_error_cb * _err)
+{
+	err = _err;
+}
+
+bool tree_sink_disk::add_folder(const wstring & path)
+{
+	if (elp->CreateDirectory(path.c_str(), NULL))
+		return true;
+
+	__on_api_error("CreateDirectory", path);
+	return false;
+}
+
+bool tree_sink_disk::add_file(const wstring & path, uint64_t bytes)
+{
+	static const char zeros[64*1024] = { 0 };
+	HANDLE h;
+	dword  n;
+	bool   ok;
+
+	h = elp->CreateFile(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+	{
+		__on_api_error("CreateFile", path);
+		return false;
+	}
+
+	if (bytes <= sizeof zeros)
+	{
+		ok = WriteFile(h, zeros, (dword)bytes, &n, NULL) && n == bytes;
+		if (! ok) __on_api_error("WriteFile", path);
+	}
+	else
+	{
+		// let the file system zero-fill it lazily
+		LARGE_INTEGER size;
+
+		size.QuadPart = bytes;
+
+		ok = SetFilePointerEx(h, size, NULL, FILE_BEGIN) && SetEndOfFile(h);
+		if (! ok) __on_api_error("SetEndOfFile", path);
+	}
+
+	CloseHandle(h);
+	return ok;
+}
+
+/*
+ *	tree_gen
+ */
+tree_gen::tree_gen(tree_sink * _sink, size_t _scale)
+{
+	sink = _sink;
+	seed = 0x9e3779b97f4a7c15ULL;
+	scale = _scale ? _scale : 1;
+	folders = 0;
+	files = 0;
+	bytes = 0;
+}
+
+bool tree_gen::generate(const wstring & root, const wstring & shape)
+{
+	if (shape == L"deep")         return gen_deep(root);
+	if (shape == L"wide")         return gen_wide(root);
+	if (shape == L"node_modules") return gen_node_modules(root);
+	if (shape == L"tiny")         return gen_tiny(root);
+	if (shape == L"huge")         return gen_huge(root);
+	if (shape == L"dirs")         return gen_dirs(root);
+
+	return false;
+}
+
+//
+bool tree_gen::gen_deep(const wstring & root)
+{
+	static const size_t path_max = 32*1000; // a bit under the 32K limit
+
+	size_t  levels = 1000 * scale;
+	size_t  chain_max;
+	wstring path;
+
+	// '\d' per level, and then '\a.tmp' at the bottom
+	__enforce(root.size() + 32 < path_max);
+	chain_max = (path_max - root.size() - 32) / 2;
+
+	for (size_t i = 0; i < levels; i++)
+	{
+		size_t chain = i / chain_max;
+
+		if (i % chain_max)
+			path += L"\\d";
+		else
+		if (! chain)
+			path = root + L"\\d";
+		else
+			path = root + from_utf8( stringf("\\d-%zu", chain+1) );
+
+		if (! folder(path) ||
+		    ! file(path + L"\\a.tmp", rand(0, 4096)) ||
+		    ! file(path + L"\\b.tmp", rand(0, 4096)))
+			return false;
+	}
+
+	return true;
+}
+
+bool tree_gen::gen_wide(const wstring & root)
+{
+	for (size_t i = 0; i < 100*1000 * scale; i++)
+	{
+		wstring name = from_utf8( stringf("\\file-%07zu.tmp", i) );
+
+		if (! file(root + name, rand(0, 4096)))
+			return false;
+	}
+
+	return true;
+}
+
+bool tree_gen::gen_node_modules(const wstring & root)
+{
+	wstring path = root + L"\\node_modules";
+
+	if (! folder(path))
+		return false;
+
+	for (size_t i = 0; i < 200 * scale; i++)
+	{
+		wstring name = from_utf8( stringf("\\package-%04zu", i) );
+
+		if (! gen_package(path + name, 0))
+			return false;
+	}
+
+	return true;
+}
+
+bool tree_gen::gen_package(const wstring & path, size_t level)
+{
+	static const wchar_t * meta[] = { L"\\package.json", L"\\README.md", L"\\LICENSE" };
+	static const wchar_t * dirs[] = { L"\\lib", L"\\dist", L"\\types" };
+
+	if (! folder(path))
+		return false;
+
+	for (auto & name : meta)
+		if (! file(path + name, rand(200, 8*1024)))
+			return false;
+
+	for (size_t i = 0, n = (size_t)rand(1, 3); i < n; i++)
+	{
+		wstring sub = path + dirs[i];
+
+		if (! folder(sub))
+			return false;
+
+		for (size_t j = 0, m = (size_t)rand(5, 30); j < m; j++)
+		{
+			wstring name = from_utf8( stringf("\\module-%02zu.js", j) );
+
+			if (! file(sub + name, rand(100, 32*1024)))
+				return false;
+		}
+	}
+
+	// about a quarter of the packages pin their own dependencies
+	if (level < 3 && rand(0, 3) == 0)
+	{
+		wstring sub = path + L"\\node_modules";
+
+		if (! folder(sub))
+			return false;
+
+		for (size_t i = 0, n = (size_t)rand(1, 5); i < n; i++)
+		{
+			wstring name = from_utf8( stringf("\\dep-%zu", i) );
+
+			if (! gen_package(sub + name, level+1))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+bool tree_gen::gen_tiny(const wstring & root)
+{
+	for (size_t i = 0; i < 1000 * scale; i++)
+	{
+		wstring path = root + from_utf8( stringf("\\d%05zu", i) );
+
+		if (! folder(path))
+			return false;
+
+		for (size_t j = 0; j < 1000; j++)
+		{
+			wstring name = from_utf8( stringf("\\f%03zu", j) );
+
+			if (! file(path + name, rand(0, 64)))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+bool tree_gen::gen_huge(const wstring & root)
+{
+	for (size_t i = 0; i < 8; i++)
+	{
+		wstring name = from_utf8( stringf("\\huge-%zu.bin", i) );
+
+		if (! file(root + name, scale * 1024*1024*1024ULL))
+			return false;
+	}
+
+	return true;
+}
+
+bool tree_gen::gen_dirs(const wstring & root)
+{
+	for (size_t i = 0; i < 1000 * scale; i++)
+	{
+		wstring path = root + from_utf8( stringf("\\d%05zu", i) );
+
+		if (! folder(path))
+			return false;
+
+		for (size_t j = 0; j < 1000; j++)
+		{
+			wstring name = from_utf8( stringf("\\e%03zu", j) );
+
+			if (! folder(path + name))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+//
+bool tree_gen::folder(const wstring & path)
+{
+	folders++;
+	return sink->add_folder(path);
+}
+
+bool tree_gen::file(const wstring & path, uint64_t _bytes)
+{
+	files++;
+	bytes += _bytes;
+	return sink->add_file(path, _bytes);
+}
+
+uint64_t tree_gen::rand() // xorshift64*
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545f4914f6cdd1dULL;
+}
+
+uint64_t tree_gen::rand(uint64_t lo, uint64_t hi)
+{
+	return lo + rand() % (hi - lo + 1);
+}
@@ -0,0 +1,83 @@
+/*
+ *	This file is a part of the source code of "byenow" program.
+ *
+ *	Copyright (c) 2020- Alexander Pankratov and IO Bureau SA.
+ *	All rights reserved.
+ *
+ *	The source code is distributed under the terms of 2-clause 
+ *	BSD license with the Commons Clause condition. See LICENSE
+ *	file for details.
+ */
+#ifndef _ULTRA_TREE_GEN_H_
+#define _ULTRA_TREE_GEN_H_
+
+#include "libp/types.h"
+#include "libp/api_error.h"
+
+/*
+ *	Reproducible synthetic trees for benchmarking - the same shape
+ *	and scale always produce the same names and file sizes.
+ *
+ *	  deep          a chain of nested folders, a couple of files each,
+ *	                split into several chains at the path length limit
+ *	  wide          a single folder with lots of files
+ *	  node_modules  nested packages with small files, like npm makes
+ *	  tiny          lots of folders with lots of tiny files
+ *	  huge          a handful of very large files
+ *	  dirs          lots of empty folders
+ *
+ *	'scale' multiplies the entry count (or file size for 'huge').
+ */
+struct tree_sink
+{
+	__interface(tree_sink);
+
+	virtual bool add_folder(const wstring & path) = 0;
+	virtual bool add_file(const wstring & path, uint64_t bytes) = 0;
+};
+
+bool is_tree_shape(const wstring & shape);
+
+//
+struct tree_sink_disk : tree_sink
+{
+	api_error_cb * err;
+
+	tree_sink_disk(api_error_cb * err);
+
+	bool add_folder(const wstring & path);
+	bool add_file(const wstring & path, uint64_t bytes);
+};
+
+//
+struct tree_gen
+{
+	tree_sink * sink;
+	uint64_t    seed;
+	size_t      scale;
+	size_t      folders;
+	size_t      files;
+	uint64_t    bytes;
+
+	//
+	tree_gen(tree_sink * sink, size_t scale);
+
+	bool generate(const wstring & root, const wstring & shape);
+
+	bool gen_deep(const wstring & root);
+	bool gen_wide(const wstring & root);
+	bool gen_node_modules(const wstring & root);
+	bool gen_tiny(const wstring & root);
+	bool gen_huge(const wstring & root);
+	bool gen_dirs(const wstring & root);
+
+	bool gen_package(const wstring & path, size_t level);
+
+	bool folder(const wstring & path);
+	bool file(const wstring & path, uint64_t bytes);
+
+	uint64_t rand();
+	uint64_t rand(uint64_t lo, uint64_t hi); // [lo, hi]
+};
+
+#endif
@@ -11,23 +11,49 @@
 #include "ultra_machine.h"
 #include "ultra_machine_internals.h"
 
-#include "delete_file.h"
+#include "utils.h"
 
 #include "libp/enforce.h"
 #include "libp/atomic.h"
+#include "libp/time.h"
 
 #include "libp/_elpify.h"
 #include "libp/_cpu_info.h"
-#include "libp/_simple_work_queue.h"
+
+//
+static const size_t ph2_min = 16;          // files per batch
+static const size_t ph2_max = 16*1024;
+static const size_t ph2_task_usecs = 10*1000;
+static const size_t ph2_group = 16;        // files per fs_api::delete_files()
+
+static const dword  tick_msecs = 50;       // also bounds the stop latency
+static const size_t retry_max_msecs = 60*1000; // backoff stops doubling here
+
+static thread_local ultra_stats * tls_stats = NULL;
 
 //
 ultra_mach_conf::ultra_mach_conf()
 {
 	threads = 0;
+	scan_threads = 0;
+	delete_threads = 0;
+	threads_auto = false;
+	threads_max = 0;
 	scanner_buf_size = 0;
 	deleter_ntapi = false;
+	file_bytes = true;
 	deleter_batch = 128;
+	deleter_batch_auto = true;
+	deleter_window = 0;
 	keep_root = false;
+	depth_first = false;
+	streaming = false;
+	scanner_chunk = 0;
+	retries = 3;
+	retry_msecs = 100;
+	fs = NULL;
+	trace = NULL;
+	jrnl = NULL;
 }
 
 //
@@ -41,7 +67,14 @@ ultra_mach_info::ultra_mach_info()
 	deleter_err = NULL;
 
 	folders_togo = 0;
+	scan_threads = 0;
+	delete_threads = 0;
 	done = false;
+
+	tail_usecs = 0;
+	first_usecs = 0;
+
+	r_queued = r_ok = r_failed = 0;
 }
 
 /*
@@ -53,68 +86,323 @@ ultra_task::ultra_task(ultra_mach * _mach)
 	phase = -1;
 	ph2_first = 0;
 	ph2_count = -1;
+	attempt = 0;
+	retry = NULL;
+	due.raw = 0;
+	del_list = NULL;
+	del_mark = 0;
 }
 
 //
 void ultra_task::execute()
 {
+	ultra_stats * st;
+	usec_t t0, started;
+	size_t items = 1;
+
 	__enforce(curr && errors.empty());
 
-	path = curr->get_path();
+	if (mach->enough)
+		goto done;
+
+	if (phase == 1 && mach->prescanned)
+		goto done; // just a visit, complete_ph1() does the rest
+
+	st = mach->get_stats();
+	curr->get_path(path);
+	t0 = started = usec();
 
 	if (phase == 1)
 	{
 		// scan folder
-		scan_folder_nt(path.c_str(), mach->conf.scanner_buf_size, this, this);
+
+		// hold the folder until complete_ph1(), so that it isn't
+		// deleted once the chunks handed off so far are through
+		if (mach->held)
+			curr->items = 1;
+
+		mach->fs->scan_folder(path, mach->conf.scanner_buf_size, this, this);
+
+		if (mach->streaming)
+			flush_stream();
+
+		t0 = usec();
+		st->scan.add(t0 - started);
+		items = curr->items;
 	}
 	else
 	if (phase == 2)
 	{
 		// delete files
 
+		const file_list & list = files();
+
 		if (ph2_first == 0 && ph2_count == -1)
-			ph2_count = curr->files.size();
+			ph2_count = list.size();
 
-		__enforce(ph2_first + ph2_count <= curr->files.size());
+		__enforce(ph2_first + ph2_count <= list.size());
 
-		for (size_t i = 0; i < ph2_count && ! mach->enough; i++)
+		size_t i, n;
+
+		// in groups, small enough to stay responsive to 'enough'
+		// and to idle peers
+
+		for (i = 0; i < ph2_count && ! mach->enough; i += n)
 		{
-			do_delete_file( curr->files[ph2_first+i] );
+			n = min(ph2_count - i, ph2_group);
+
+			do_delete_files(path, list, ph2_first + i, n);
+			split_ph2(i+n);
 		}
+
+		t0 = usec();
+		mach->on_ph2_timing(i, t0 - started);
+		items = i;
 	}
 	else
 	if (phase == 3)
 	{
-		do_delete_self();
+		if (do_delete_self() && mach->conf.jrnl)
+			mach->conf.jrnl->add(path);
+
+		t0 = usec();
+		st->folder.add(t0 - started);
 	}
 	else
 	{
 		__enforce(false);
 	}
 
+	if (mach->conf.trace)
+		mach->conf.trace->add(phase, path, items, started, t0);
+
 	path.clear();
+
+done:
+	mach->complete(this); // recycles 'this'
+}
+
+/*
+ *	If there are idle workers, hand them the second half of what
+ *	is left of this batch. This evens out the tail of the run when
+ *	the queue is running dry, but a handful of large batches are
+ *	still in progress.
+ */
+void ultra_task::split_ph2(size_t done)
+{
+	ultra_task * w;
+	size_t left = ph2_count - done;
+
+	if (mach->enough ||
+	    chunk.size() ||   // not shared
+	    ! mach->conf.deleter_batch_auto ||
+	    ! mach->deleters.sleepers ||
+	    left < 2*ph2_min)
+		return;
+
+	w = mach->pool.get(curr, 2);
+	w->ph2_count = left / 2;
+	w->ph2_first = ph2_first + ph2_count - w->ph2_count;
+
+	ph2_count -= w->ph2_count;
+
+	atomic_inc(&mach->ph2_work);
+	mach->enqueue(w);
+}
+
+void ultra_task::do_delete_files(wstring & folder, const file_list & files, size_t first, size_t count)
+{
+	uint64_t bytes = 0;
+	size_t   n;
+
+	del_list = &files;
+	del_mark = errors.size();
+
+	n = mach->fs->delete_files(folder, files, first, count, bytes, this, this);
+
+	if (attempt)
+		atomic_add(&mach->info.r_ok, n);
+
+	atomic_add(&mach->info.f_deleted, n);
+	atomic_add(&mach->info.b_deleted, bytes);
+}
+
+bool ultra_task::on_file_deleted(size_t i, uint64_t usecs)
+{
+	mach->get_stats()->file.add(usecs);
+
+	del_mark = errors.size();
+	return ! mach->enough;
+}
+
+bool ultra_task::on_file_failed(size_t i)
+{
+	const file_list & files = *del_list;
+
+	// errors[del_mark...] are this file's
+	if (mach->conf.retries && should_retry(del_mark))
+	{
+		const wchar_t * name = files.names.data();
+		fsi_info info;
+
+		info.attrs = files.attrs[i];
+		info.bytes = files.get_bytes(i);
+
+		get_retry()->chunk.add( wc_range(name + files.name_pos(i), name + files.name_end[i]),
+		                        info, files.bytes.size() > 0 );
+	}
+
+	del_mark = errors.size();
+	return ! mach->enough;
+}
+
+/*
+ *	In streaming mode files are deleted in small batches while
+ *	their folder is still being scanned. Only subfolders make it
+ *	into the tree, so the memory use is down to the folder count,
+ *	and the names are touched just once, while they're still in
+ *	the cache.
+ */
+void ultra_task::flush_stream()
+{
+	size_t n = stream.size();
+
+	if (! n)
+		return;
+
+	if (! mach->enough)
+	{
+		size_t before = retry ? retry->chunk.size() : 0;
+		size_t mark = errors.size();
+
+		// 'path' is the scan's, so names are appended to a copy
+		scratch.assign(path);
+		do_delete_files(scratch, stream, 0, n);
+
+		// unlike the rest of 'stream', these now need to be waited for
+		if (retry && retry->chunk.size() > before)
+			atomic_add(&curr->items, retry->chunk.size() - before);
+
+		// and these are deleter errors, not the scanner's
+		s_errors.insert(s_errors.end(), errors.begin() + mark, errors.end());
+		errors.resize(mark);
+	}
+
+	stream.clear();
+}
+
+/*
+ *	When pipelined, files are handed off to ph2 in chunks while the
+ *	folder is still being scanned, so that deleting a large folder
+ *	overlaps with its enumeration instead of waiting for it. Each
+ *	chunk is moved out into the task, so the scan can carry on with
+ *	a fresh 'curr->files'.
+ */
+void ultra_task::flush_chunk()
+{
+	ultra_task * w = mach->pool.get(curr, 2);
+
+	w->chunk.swap(curr->files);
+	w->ph2_first = 0;
+	w->ph2_count = w->chunk.size();
+
+	atomic_inc(&mach->ph2_work);
+	mach->enqueue(w);
+}
+
+bool ultra_task::do_delete_self()
+{
+	size_t mark = errors.size();
+
+	if (! mach->fs->delete_folder(path, curr->self.info.attrs, this))
+	{
+		if (mach->conf.retries && should_retry(mark))
+			get_retry();
+
+		return false;
+	}
+
+	if (attempt)
+		atomic_inc(&mach->info.r_ok);
+
+	atomic_inc(&mach->info.d_deleted);
+	return true;
+}
+
+/*
+ *	Sharing violations, locked files, pending deletes and "directory
+ *	not empty" are often down to someone else briefly holding on to
+ *	the item, so these are given a few more goes before being
+ *	reported. All the errors logged for the item must be of this
+ *	kind. Plain access denied is not, it won't go away by itself.
+ */
+static bool is_transient(dword code)
+{
+	switch (code)
+	{
+	case ERROR_SHARING_VIOLATION:
+	case ERROR_LOCK_VIOLATION:
+	case ERROR_DELETE_PENDING:    // see delete_file.cpp
+	case ERROR_DIR_NOT_EMPTY:
+	case 0xC0000043:              // STATUS_SHARING_VIOLATION
+	case 0xC0000054:              // STATUS_FILE_LOCK_CONFLICT
+	case 0xC0000056:              // STATUS_DELETE_PENDING
+	case 0xC0000101:              // STATUS_DIRECTORY_NOT_EMPTY
+	case 0xC0000121:              // STATUS_CANNOT_DELETE
+		return true;
+	}
+
+	return false;
 }
 
-void ultra_task::do_delete_file(const fsi_item & f)
+static bool is_not_empty(dword code)
 {
-	wstring file = path + L'\\' + f.name;
+	return code == ERROR_DIR_NOT_EMPTY ||
+	       code == 0xC0000101; // STATUS_DIRECTORY_NOT_EMPTY
+}
+
+bool ultra_task::should_retry(size_t mark)
+{
+	folder * x;
+
+	// errors[mark...] are for the item that just failed
+
+	if (errors.size() == mark)
+		return false; // quietly, see delete_file_ntapi()
+
+	// a folder that is stuck with a failed child won't ever empty
+	for (size_t i = mark; i < errors.size(); i++)
+		if (! is_transient(errors[i].code) ||
+		    (curr->stuck && is_not_empty(errors[i].code)))
+			goto nope;
 
-	if (delete_file(file, f.info.attrs, mach->conf.deleter_ntapi, this))
+	if (attempt < mach->conf.retries)
 	{
-		atomic_inc(&mach->info.f_deleted);
-		atomic_add(&mach->info.b_deleted, f.info.bytes);
+		errors.resize(mark);
+		return true;
 	}
 
-	atomic_dec(&curr->items);
+nope:
+	if (attempt)
+		atomic_inc(&mach->info.r_failed);
+
+	// the item's folder is stuck now, and once it fails to go,
+	// so is its parent, and so on
+	x = (phase == 3) ? curr->parent : curr;
+	if (x) x->stuck = true;
+
+	return false;
 }
 
-void ultra_task::do_delete_self()
+ultra_task * ultra_task::get_retry()
 {
-	if (delete_folder(path, curr->self.info.attrs, this))
-		atomic_inc(&mach->info.d_deleted);
+	if (! retry)
+	{
+		retry = mach->pool.get(curr, phase == 3 ? 3 : 2);
+		retry->attempt = attempt + 1;
+	}
 
-	if (curr->parent)
-		atomic_dec(&curr->parent->items);
+	return retry;
 }
 
 //
@@ -126,23 +414,42 @@ bool ultra_task::on_fsi_scan(const wc_range & name, const fsi_info & info)
 
 		sub = new folder();
 		sub->parent = curr;
+		sub->index = curr->folders.size();
 		sub->self = fsi_item(name, info);
 
 		curr->folders.push_back(sub);
-		curr->items++;
+
+		if (mach->held) atomic_inc(&curr->items); // vs complete_ph2()
+		else            curr->items++;
 
 		atomic_inc(&mach->info.d_found);
 	}
 	else
+	if (mach->streaming)
 	{
-		curr->files.push_back( fsi_item(name, info) );
-		curr->items++;
+		stream.add(name, info, mach->conf.file_bytes);
 
 		atomic_inc(&mach->info.f_found);
 		atomic_add(&mach->info.b_found, info.bytes);
+
+		if (stream.size() == ph2_group)
+			flush_stream();
 	}
+	else
+	{
+		curr->files.add(name, info, mach->conf.file_bytes);
 
-	return true;
+		if (mach->held) atomic_inc(&curr->items);
+		else            curr->items++;
+
+		atomic_inc(&mach->info.f_found);
+		atomic_add(&mach->info.b_found, info.bytes);
+
+		if (mach->pipelined && curr->files.size() == mach->conf.scanner_chunk)
+			flush_chunk();
+	}
+
+	return ! mach->enough; // stop scanning if cancelled
 }
 
 //
@@ -158,6 +465,8 @@ ultra_task_pool::ultra_task_pool()
 {
 	mach = NULL;
 	allocated = 0;
+
+	InitializeSRWLock(&lock);
 }
 
 ultra_task_pool::~ultra_task_pool()
@@ -168,10 +477,17 @@ ultra_task_pool::~ultra_task_pool()
 
 ultra_task * ultra_task_pool::get(folder * d, int phase)
 {
-	ultra_task * w;
+	ultra_task * w = NULL;
+
+	AcquireSRWLockExclusive(&lock);
 
 	if (cache.size()) { w = cache.back(); cache.pop_back(); }
-	else              { w = new ultra_task(mach); allocated++; }
+	else              { allocated++; }
+
+	ReleaseSRWLockExclusive(&lock);
+
+	if (! w)
+		w = new ultra_task(mach);
 
 	w->phase = phase;
 	w->curr = d;
@@ -182,9 +498,15 @@ void ultra_task_pool::put(ultra_task * w)
 {
 	w->curr = NULL;
 	w->phase = -1;
+	w->chunk.release();
+	w->attempt = 0;
+	w->retry = NULL;
 	w->errors.clear();
+	w->s_errors.clear();
 
+	AcquireSRWLockExclusive(&lock);
 	cache.push_back(w);
+	ReleaseSRWLockExclusive(&lock);
 }
 
 bool ultra_task_pool::unused() const
@@ -197,20 +519,47 @@ bool ultra_task_pool::unused() const
  */
 ultra_mach::ultra_mach()
 {
+	cb = NULL;
+	fs = NULL;
 	ph1_only = false;
+	prescanned = false;
+	streaming = false;
+	pipelined = false;
+	held = false;
 	enough = false;
 	ph1_work = ph2_work = ph3_work = 0;
 	ph1_done = ph2_done = ph3_done = 0;
+
+	file_nsecs = 0;
+	tail_from.raw = 0;
+
+	pending = 1;
+	finished = NULL;
+
+	deferred = 0;
+
+	InitializeSRWLock(&cursor_lock);
+	InitializeSRWLock(&retry_lock);
+	InitializeSRWLock(&err_lock);
+	InitializeSRWLock(&stats_lock);
 }
 
 ultra_mach::~ultra_mach()
 {
 	term();
+
+	for (auto & x : stats)
+		delete x;
+
+	if (finished)
+		CloseHandle(finished);
 }
 
 //
 bool ultra_mach::init(const ultra_mach_conf & _conf, ultra_mach_cb * _cb)
 {
+	size_t spawned;
+
 	conf = _conf;
 	cb = _cb;
 
@@ -223,53 +572,267 @@ bool ultra_mach::init(const ultra_mach_conf & _conf, ultra_mach_cb * _cb)
 	if (conf.threads == 0 || conf.threads == -1)
 		conf.threads = get_cpu_count();
 
+	// split 'threads' between the pools, unless told otherwise
+
+	if (! conf.scan_threads)
+	{
+		if (ph1_only)        conf.scan_threads = conf.threads;
+		else if (prescanned) conf.scan_threads = max<size_t>(conf.threads / 4, 1); // just visiting
+		else                 conf.scan_threads = max<size_t>(conf.threads / 2, 1);
+	}
+
+	if (ph1_only)
+		conf.delete_threads = 0;
+	else
+	if (! conf.delete_threads)
+		conf.delete_threads = max<size_t>(conf.threads - min(conf.scan_threads, conf.threads), 1);
+
+	if (conf.threads_auto && ! conf.threads_max)
+		conf.threads_max = max<size_t>(4 * get_cpu_count(), 32);
+
+	if (! conf.deleter_window)
+		conf.deleter_window = max<size_t>(64 * max(conf.delete_threads, conf.threads_max), 1024);
+
+	// refill() sees the completing tasks still in 'pending', so
+	// unless the window is above all workers completing at once,
+	// the run may finish with folders still on the cursor
+
+	spawned = conf.threads_auto ? max(conf.threads_max, conf.scan_threads) + max(conf.threads_max, conf.delete_threads)
+	                            : conf.scan_threads + conf.delete_threads;
+
+	conf.deleter_window = max(conf.deleter_window, spawned + 2); // + the initial hold
+
+	info.scan_threads = conf.scan_threads;
+	info.delete_threads = conf.delete_threads;
+
+	native.ntapi = conf.deleter_ntapi;
+	fs = conf.fs ? conf.fs : &native;
+
 	pool.mach = this;
 
-	return swq.init(conf.threads, NULL);
+	finished = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (! finished)
+		return false;
+
+	// scanning and deleting run in separate pools, so that neither
+	// can starve the other of threads, and just scanning needs no
+	// deleters at all
+	//
+	// breadth-first is FIFO, which is close to simple_work_queue
+	// depth-first is most recently found first, with ph3 ahead of
+	// ph2. With separate pools ph2 can't be put ahead of ph1, both
+	// simply run side by side
+
+	if (! init_pool(scanners, scan_tuner, conf.scan_threads, 1))
+		return false;
+
+	return ph1_only || init_pool(deleters, delete_tuner, conf.delete_threads, 2);
+}
+
+bool ultra_mach::init_pool(steal_queue & q, thread_tuner & t, size_t threads, size_t levels)
+{
+	size_t spawn = threads;
+	bool ok;
+
+	if (conf.threads_auto)
+	{
+		spawn = max(conf.threads_max, threads);
+		t.init(1, spawn, threads);
+	}
+
+	ok = conf.depth_first ? q.init(spawn, levels, true)
+	                      : q.init(spawn, 1, false);
+
+	q.set_active(threads);
+	return ok;
 }
 
 void ultra_mach::term()
 {
 	work_item_vec out;
 
-	swq.cancel(out);
+	// workers of either pool may queue into the other, so both
+	// are stopped before either is taken apart
+
+	scanners.halt();
+	deleters.halt();
+
+	scanners.join();
+	deleters.join();
+
+	scanners.cancel(out);
+	deleters.cancel(out);
+
+	for (auto & w : retry_q)
+		out.push_back(w);
+
+	retry_q.clear();
 
 	for (auto & wi : out) 
 		pool.put( (ultra_task*)wi );
+
+	// the workers are gone and so are their caches, so if the
+	// tree was deleted in full, its slabs can go too
+	folder_pool::trim();
 }
 
 //
-bool ultra_mach::keep_going() const
+void ultra_mach::enqueue(ultra_task * w)
 {
-	if (enough)
-		return false;
+	atomic_inc(&pending);
 
-	return (ph1_done < ph1_work) || (ph2_done < ph2_work) || (ph3_done < ph3_work);
+	if (w->phase == 1) scanners.enqueue(w, 0);
+	else               deleters.enqueue(w, conf.depth_first ? w->phase-2 : 0);
 }
 
-//
 void ultra_mach::enqueue_ph1(folder * x)
 {
-	swq.enqueue( pool.get(x, 1) );
-	ph1_work++;
+	atomic_inc(&ph1_work);
+	enqueue( pool.get(x, 1) );
+}
+
+/*
+ *	With a prescanned tree the visits run far ahead of deleting,
+ *	so they are held back once there's enough work in flight and
+ *	resumed by refill() as it drains. This caps the number of
+ *	tasks, and the size of the queues, regardless of tree size.
+ *
+ *	The cursor is a stack, so it's picked up depth-first, which
+ *	finishes off subtrees and releases their nodes sooner.
+ */
+void ultra_mach::enqueue_visit(folder * x)
+{
+	if (pending < conf.deleter_window)
+	{
+		enqueue_ph1(x);
+		return;
+	}
+
+	AcquireSRWLockExclusive(&cursor_lock);
+	cursor.push_back(x);
+	deferred = cursor.size();
+	ReleaseSRWLockExclusive(&cursor_lock);
+}
+
+void ultra_mach::refill()
+{
+	// called with the completed task still counted in 'pending',
+	// so the cursor can't be left non-empty once it hits zero
+
+	while (deferred && pending < conf.deleter_window)
+	{
+		folder * x = NULL;
+
+		AcquireSRWLockExclusive(&cursor_lock);
+		if (cursor.size())
+		{
+			x = cursor.back();
+			cursor.pop_back();
+			deferred = cursor.size();
+		}
+		ReleaseSRWLockExclusive(&cursor_lock);
+
+		if (! x)
+			break;
+
+		enqueue_ph1(x);
+	}
 }
 
 void ultra_mach::enqueue_ph2(folder * x)
 {
 	ultra_task * w;
 	size_t total = x->files.size();
+	size_t batch = ph2_batch(total);
 
 	for (size_t chunk, start = 0; start < total; start += chunk)
 	{
-		chunk = min(total - start, conf.deleter_batch);
+		chunk = min(total - start, batch);
 
 		w = pool.get(x, 2);
 		w->ph2_first = start;
 		w->ph2_count = chunk;
 
-		swq.enqueue(w);
-		ph2_work++;
+		atomic_inc(&ph2_work);
+		enqueue(w);
+	}
+}
+
+/*
+ *	Batches are sized to take about ph2_task_usecs each, based on
+ *	how long it's been taking to delete a file so far. This keeps
+ *	the per-task overhead low for fast deletes and still allows for
+ *	balancing when they are slow.
+ */
+size_t ultra_mach::ph2_batch(size_t total)
+{
+	size_t threads = deleters.active;
+	size_t batch;
+
+	if (! conf.deleter_batch_auto)
+		return conf.deleter_batch;
+
+	batch = file_nsecs ? ph2_task_usecs * 1000 / file_nsecs : conf.deleter_batch;
+
+	// spread large folders across all workers
+	batch = min(batch, (total + threads - 1) / threads);
+
+	// go for smaller tasks still when the queue is running low
+	if (deleters.queued < threads)
+		batch /= 2;
+
+	return min(max(batch, ph2_min), ph2_max);
+}
+
+void ultra_mach::on_ph2_timing(size_t files, uint64_t usecs)
+{
+	size_t avg = file_nsecs;
+	size_t now;
+
+	if (! files)
+		return;
+
+	now = (size_t)(usecs * 1000 / files);
+
+	// exponential moving average, racy, but that's OK
+	file_nsecs = avg ? avg - avg/8 + now/8 : now;
+}
+
+/*
+ *	Retries are parked until they are due and then queued by the
+ *	main thread in tick_retries(), so workers never wait on them.
+ *	They count towards 'pending' while parked, and their items are
+ *	still counted in their folder's 'items'.
+ */
+void ultra_mach::enqueue_retry(ultra_task * w)
+{
+	size_t   n = 1;
+	uint64_t delay; // msecs
+
+	if (w->phase == 2)
+	{
+		n = w->chunk.size();
+		w->ph2_first = 0;
+		w->ph2_count = n;
+		atomic_inc(&ph2_work);
+	}
+	else
+	{
+		atomic_inc(&ph3_work);
 	}
+
+	delay = min<uint64_t>(conf.retry_msecs, retry_max_msecs);
+	for (size_t i = 1; i < w->attempt && delay < retry_max_msecs; i++)
+		delay *= 2;
+
+	w->due.raw = usec().raw + min<uint64_t>(delay, retry_max_msecs) * 1000;
+
+	atomic_add(&info.r_queued, n);
+	atomic_inc(&pending);
+
+	AcquireSRWLockExclusive(&retry_lock);
+	retry_q.push_back(w);
+	ReleaseSRWLockExclusive(&retry_lock);
 }
 
 void ultra_mach::enqueue_ph3(folder * x)
@@ -282,128 +845,295 @@ void ultra_mach::enqueue_ph3(folder * x)
 
 	x->items = -1; // being deleted
 
-	swq.enqueue( pool.get(x, 3) );
-	ph3_work++;
+	atomic_inc(&ph3_work);
+	enqueue( pool.get(x, 3) );
 }
 
 //
-void ultra_mach::complete_ph1(ultra_task * w)
+void ultra_mach::complete(ultra_task * w)
 {
-	__enforce(! enough);
-	__enforce(w->phase == 1);
+	if (! enough)
+	{
+		switch (w->phase)
+		{
+		case 1: complete_ph1(w); break;
+		case 2: complete_ph2(w); break;
+		case 3: complete_ph3(w); break;
+		default: __enforce(false);
+		}
+
+		if (prescanned)
+			refill();
+	}
 
-	// w->curr scanned
+	if (w->retry)
+	{
+		if (! enough) enqueue_retry(w->retry);
+		else          pool.put(w->retry);
 
-	ph1_done++;
+		w->retry = NULL;
+	}
 
-	for (auto & x : w->curr->folders)
+	if (w->errors.size() || w->s_errors.size())
 	{
-		if (x->self.info.attrs & FILE_ATTRIBUTE_REPARSE_POINT)
-			continue;
+		api_error_vec & vec = (w->phase == 1) ? scanner_err : deleter_err;
 
-		enqueue_ph1(x); // scan subfolders
+		AcquireSRWLockExclusive(&err_lock);
+		append(vec, w->errors);
+		append(deleter_err, w->s_errors);
+		ReleaseSRWLockExclusive(&err_lock);
 	}
 
+	pool.put(w);
+
+	// follow-up work, if any, is already counted in
+	if (atomic_dec(&pending) == 0)
+		SetEvent(finished);
+}
+
+void ultra_mach::complete_ph1(ultra_task * w)
+{
+	folder * x = w->curr;
+	size_t   n = x->folders.size();
+
+	__enforce(w->phase == 1);
+
+	// w->curr scanned, or just visited if prescanned
+
+	atomic_inc(&ph1_done);
+
 	if (! ph1_only)
 	{
-		if (w->curr->files.size())
-			enqueue_ph2(w->curr);
+		if (x->files.size())
+			enqueue_ph2(x);
 		else
-		if (w->curr->folders.empty())
-			enqueue_ph3(w->curr);
-
-		// ^ same as in ultra_mach_delete()
+		if (! n && ! held)
+			enqueue_ph3(x);
 	}
 
-	//
-	info.folders_togo = ph1_work - ph1_done;
+	// once the last subfolder is handed off, 'x' may be deleted
+	// and freed at any moment, so it's not to be touched after,
+	// unless it's still held from the scan
 
-	info.scanner_err = &w->errors;
-	enough = ! cb->on_ultra_mach_tick(info);
-	info.scanner_err = NULL;
+	for (size_t i = 0; i < n; i++)
+	{
+		folder * sub = x->folders[i];
 
-	//
-	pool.put(w);
+		if (sub->self.info.attrs & FILE_ATTRIBUTE_REPARSE_POINT)
+		{
+			// not followed, but the link itself is removed
+			if (! ph1_only)
+				enqueue_ph3(sub);
+
+			continue;
+		}
+
+		if (prescanned) enqueue_visit(sub);
+		else            enqueue_ph1(sub); // scan subfolders
+	}
+
+	if (held && atomic_dec(&x->items) == 0)
+		enqueue_ph3(x);
 }
 
 void ultra_mach::complete_ph2(ultra_task * w)
 {
-	__enforce(! enough);
 	__enforce(w->phase == 2);
 
-	// w->curr->files deleted
+	// w->files()[first, first+count-1] deleted
 
-	ph2_done++;
+	// failed ones that are to be retried are still pending
+	size_t done = w->ph2_count - (w->retry ? w->retry->chunk.size() : 0);
 
 	// if fully processed
-	if (w->curr->items == 0)
+	if (atomic_sub(&w->curr->items, done) == 0)
 	{
 		// save some space
-		w->curr->files.clear(); 
+		w->curr->files.release();
 
-		// delete the folder 
+		// delete the folder
 		enqueue_ph3(w->curr);
 	}
 
-	//
-	info.deleter_err = &w->errors;
-	enough = ! cb->on_ultra_mach_tick(info);
-	info.deleter_err = NULL;
-
-	pool.put(w);
+	atomic_inc(&ph2_done);
 }
 
 void ultra_mach::complete_ph3(ultra_task * w)
 {
-	__enforce(! enough);
+	folder * parent = w->curr->parent;
+
 	__enforce(w->phase == 3);
 
-	// w->curr deleted
+	// w->curr deleted, or will be retried
+
+	atomic_inc(&ph3_done);
 
-	ph3_done++;
+	if (! parent || w->retry) // root is owned by the caller
+		return;
+
+	// release the node right away rather than keeping it
+	// around until the root is destroyed
+	parent->folders[w->curr->index] = NULL;
+	delete w->curr;
+	w->curr = NULL;
 
 	// if parent is fully processed
-	if (w->curr->parent && 
-	    w->curr->parent->items == 0)
+	if (atomic_dec(&parent->items) == 0)
+		enqueue_ph3(parent);
+}
+
+/*
+ *	Workers record latencies into their own ultra_stats, these
+ *	are merged into 'info' only at the very end.
+ */
+ultra_stats * ultra_mach::get_stats()
+{
+	ultra_stats * st = tls_stats;
+
+	if (st && st->mach == this)
+		return st;
+
+	st = new ultra_stats();
+	st->mach = this;
+
+	AcquireSRWLockExclusive(&stats_lock);
+	stats.push_back(st);
+	ReleaseSRWLockExclusive(&stats_lock);
+
+	return tls_stats = st;
+}
+
+void ultra_mach::merge_stats()
+{
+	AcquireSRWLockExclusive(&stats_lock);
+
+	for (auto & st : stats)
 	{
-		enqueue_ph3(w->curr->parent);
+		info.lat_scan.merge(st->scan);
+		info.lat_file.merge(st->file);
+		info.lat_folder.merge(st->folder);
 	}
 
-	pool.put(w);
+	ReleaseSRWLockExclusive(&stats_lock);
 }
 
-void ultra_mach::loop()
+/*
+ *	The main thread merely samples the progress and passes it
+ *	to the callback. All the actual work, including spawning of
+ *	follow-up tasks, happens on the worker threads.
+ */
+void ultra_mach::tick()
 {
-	work_item_vec  out;
+	api_error_vec  s_err, d_err;
+
+	AcquireSRWLockExclusive(&err_lock);
+	s_err.swap(scanner_err);
+	d_err.swap(deleter_err);
+	ReleaseSRWLockExclusive(&err_lock);
+
+	usec_t now = usec();
 
-	while ( keep_going() )
+	info.folders_togo = ph1_work - ph1_done;
+
+	if (! info.first_usecs && info.f_deleted)
+		info.first_usecs = now.raw - started.raw;
+
+	tick_tail(now);
+
+	if (! enough)
+		tick_retries(now);
+
+	if (conf.threads_auto)
 	{
-		swq.collect(out, 50);
+		scanners.set_active( scan_tuner.tick(info.d_found + info.f_found, now) );
 
-		for (auto & wi : out)
-		{
-			ultra_task * w = (ultra_task *)wi;
-
-			if (enough)
-			{
-				pool.put(w);
-				continue;
-			}
-
-			switch (w->phase)
-			{
-			case 1: complete_ph1(w); break;
-			case 2: complete_ph2(w); break;
-			case 3: complete_ph3(w); break;
-			default: __enforce(false);
-			}
-		}
+		if (! ph1_only)
+			deleters.set_active( delete_tuner.tick(info.d_deleted + info.f_deleted, now) );
+
+		info.scan_threads = scanners.active;
+		info.delete_threads = deleters.active;
+	}
+
+	info.scanner_err = s_err.size() ? &s_err : NULL;
+	info.deleter_err = d_err.size() ? &d_err : NULL;
+
+	if (! cb->on_ultra_mach_tick(info))
+		enough = true;
+
+	info.scanner_err = NULL;
+	info.deleter_err = NULL;
+}
+
+/*
+ *	The tail is the stretch at the end of the run when there's
+ *	not enough work left to keep all threads busy. It's sampled
+ *	once per tick, so it's only as accurate as that.
+ */
+void ultra_mach::tick_tail(usec_t now)
+{
+	steal_queue & q = ph1_only ? scanners : deleters;
+
+	if (pending >= q.active)
+		tail_from.raw = 0;
+	else
+	if (! tail_from.raw)
+		tail_from = now;
+
+	info.tail_usecs = tail_from.raw ? now.raw - tail_from.raw : 0;
+}
+
+void ultra_mach::tick_retries(usec_t now)
+{
+	ultra_task_vec due;
 
-		out.clear();
+	AcquireSRWLockExclusive(&retry_lock);
+
+	for (size_t i = 0; i < retry_q.size(); )
+	{
+		if (retry_q[i]->due.raw > now.raw) { i++; continue; }
+
+		due.push_back(retry_q[i]);
+		retry_q[i] = retry_q.back();
+		retry_q.pop_back();
+	}
+
+	ReleaseSRWLockExclusive(&retry_lock);
+
+	// 'pending' is bumped by enqueue() first, so it can't hit 0 here
+	for (auto & w : due)
+	{
+		enqueue(w);
+		atomic_dec(&pending);
+	}
+}
+
+void ultra_mach::loop()
+{
+	bool over;
+
+	// release the hold taken in ctor, all initial work is queued now
+	if (atomic_dec(&pending) == 0)
+		SetEvent(finished);
+
+	started = usec();
+
+	do
+	{
+		over = (WaitForSingleObject(finished, tick_msecs) == WAIT_OBJECT_0);
+
+		tick();
 	}
+	while (! over && ! enough);
+
+	// if cancelled, the caller follows up with term(), which drops
+	// all queued tasks without running them and waits for the ones
+	// in progress. These notice 'enough' within a single file or a
+	// directory entry and bail out.
 
 	if (! enough)
 	{
+		merge_stats();
+
 		info.done = true;
 		cb->on_ultra_mach_tick(info);
 	}
@@ -419,13 +1149,13 @@ bool ultra_mach_scan(folder & root, const ultra_mach_conf & conf, ultra_mach_cb
 	//
 	__enforce(! root.self.name.empty()); // path is set
 
+	mach.ph1_only = true;
+
 	if (! mach.init(conf, cb))
 		return false;
 
-	mach.ph1_only = true;
-
-	mach.enqueue_ph1(&root);
 	mach.info.d_found = 1;
+	mach.enqueue_ph1(&root);
 
 	mach.loop();
 	mach.term();
@@ -433,32 +1163,26 @@ bool ultra_mach_scan(folder & root, const ultra_mach_conf & conf, ultra_mach_cb
 	return ! mach.enough;
 }
 
-//
+/*
+ *	The prescanned tree is walked the same way it was scanned,
+ *	except that ph1 tasks merely visit folders. This spreads the
+ *	walk across the scanners and lets deleting start right away
+ *	instead of after the whole tree is queued up.
+ */
 static
 bool ultra_mach_delete(folder & root, const ultra_mach_conf & conf, ultra_mach_cb * cb)
 {
-	ultra_mach     mach;
-	folder_vec     list;
-	work_item_vec  out;
+	ultra_mach  mach;
 
 	//
 	__enforce(! root.self.name.empty()); // path is set
 
+	mach.prescanned = true;
+
 	if (! mach.init(conf, cb))
 		return false;
 
-	root.census(list);
-
-	for (auto & x : list)
-	{
-		if (x->files.size())
-			mach.enqueue_ph2(x);
-		else
-		if (x->folders.empty())
-			mach.enqueue_ph3(x);
-
-		// ^ same as complete_ph1()
-	}
+	mach.enqueue_ph1(&root);
 
 	mach.loop();
 	mach.term();
@@ -475,13 +1199,16 @@ bool ultra_mach_scan_and_delete(folder & root, const ultra_mach_conf & conf, ult
 	//
 	__enforce(! root.self.name.empty()); // path is set
 
+	mach.ph1_only = false;
+	mach.streaming = conf.streaming;
+	mach.pipelined = ! conf.streaming && conf.scanner_chunk;
+	mach.held = mach.pipelined || mach.streaming;
+
 	if (! mach.init(conf, cb))
 		return false;
 
-	mach.ph1_only = false;
-
-	mach.enqueue_ph1(&root);
 	mach.info.d_found = 1;
+	mach.enqueue_ph1(&root);
 
 	mach.loop();
 	mach.term();
@@ -12,15 +12,35 @@
 #define _ULTRA_MACHINE_H_
 
 #include "folder.h"
+#include "fs_api.h"
+#include "journal.h"
+#include "latency_hist.h"
+#include "tracer.h"
 
 //
 struct ultra_mach_conf
 {
 	size_t  threads;
+	size_t  scan_threads;   // 0 - a share of 'threads'
+	size_t  delete_threads; // 0 - the rest of 'threads'
+	bool    threads_auto;   // adjust active thread counts on the fly
+	size_t  threads_max;    // ... up to this many per pool
 	size_t  scanner_buf_size;
 	bool    deleter_ntapi;
+	bool    file_bytes;     // keep file sizes, for b_deleted
 	size_t  deleter_batch;
+	bool    deleter_batch_auto; // deleter_batch is just a starting point
+	size_t  deleter_window; // tasks in flight for prescanned deletes, 0 - auto
 	bool    keep_root;
+	bool    depth_first; // finish subtrees before moving on
+	bool    streaming;   // delete files as they are found, see ultra_task::flush_stream()
+	size_t  scanner_chunk; // hand files off to ph2 every this many while scanning, 0 - don't
+	size_t  retries;     // of transient delete errors, per item
+	size_t  retry_msecs; // before the first retry, doubles after
+
+	fs_api * fs;         // NULL - the actual file system
+	tracer * trace;      // optional
+	journal * jrnl;      // optional, gets deleted folders
 
 	ultra_mach_conf();
 };
@@ -35,8 +55,21 @@ struct ultra_mach_info
 	api_error_vec * deleter_err;
 
 	size_t  folders_togo;
+	size_t  scan_threads;   // active
+	size_t  delete_threads;
 	bool    done;
 
+	uint64_t  tail_usecs;  // with fewer tasks left than threads
+	uint64_t  first_usecs; // until the first file got deleted
+
+	size_t    r_queued;    // retries of transient errors, all attempts
+	size_t    r_ok;        // items deleted on a retry
+	size_t    r_failed;    // ... and still not deleted after the last one
+
+	latency_hist  lat_scan;    // per folder, merged once done
+	latency_hist  lat_file;    // per file
+	latency_hist  lat_folder;  // per folder removal
+
 	ultra_mach_info();
 };
 
@@ -12,13 +12,25 @@
 #define _ULTRA_MACHINE_INTERNAL_H_
 
 #include "ultra_machine.h"
-#include "libp/_simple_work_queue.h"
+#include "steal_queue.h"
+#include "thread_tuner.h"
 
 //
 struct ultra_mach;
 
 //
-struct ultra_task : work_item, fsi_scan_cb, api_error_cb
+struct ultra_stats // per worker thread
+{
+	ultra_mach    * mach;
+	latency_hist    scan;
+	latency_hist    file;
+	latency_hist    folder;
+};
+
+typedef vector<ultra_stats *> ultra_stats_vec;
+
+//
+struct ultra_task : work_item, fsi_scan_cb, delete_files_cb, api_error_cb
 {
 	ultra_task(ultra_mach * mach);
 
@@ -28,8 +40,14 @@ struct ultra_task : work_item, fsi_scan_cb, api_error_cb
 	 *	work_item
 	 */
 	void execute();
-	void do_delete_file(const fsi_item & f);
-	void do_delete_self();
+	void split_ph2(size_t done);
+	void do_delete_files(wstring & folder, const file_list & files, size_t first, size_t count);
+	void flush_stream();
+	void flush_chunk();
+	bool should_retry(size_t mark);
+	ultra_task * get_retry();
+	const file_list & files() const { return chunk.size() ? chunk : curr->files; }
+	bool do_delete_self();
 
 	/*
 	 *	fsi_scan_cb
@@ -37,6 +55,12 @@ struct ultra_task : work_item, fsi_scan_cb, api_error_cb
 	void on_fsi_open(HANDLE h) { }
 	bool on_fsi_scan(const wc_range & name, const fsi_info & info);
 
+	/*
+	 *	delete_files_cb
+	 */
+	bool on_file_deleted(size_t i, uint64_t usecs);
+	bool on_file_failed(size_t i);
+
 	/*
 	 *	api_error_cb
 	 */
@@ -47,11 +71,21 @@ struct ultra_task : work_item, fsi_scan_cb, api_error_cb
 	folder       * curr;
 	int            phase;
 
-	size_t         ph2_first; // delete curr->files[first, first+count-1]
+	size_t         ph2_first; // delete files()[first, first+count-1]
 	size_t         ph2_count;
+	file_list      chunk;     // taken from curr->files mid-scan, or failed
+	size_t         attempt;   // 0 - first go, then a retry
+	ultra_task   * retry;     // to have another go at what failed
+	usec_t         due;       // of this retry
+
+	const file_list * del_list; // of do_delete_files(), for on_file_failed()
+	size_t         del_mark;  // errors.size() before the current file
 
-	wstring        path;
+	wstring        path;      // of 'curr', reused across tasks
+	file_list      stream;    // files found, but not deleted yet
+	wstring        scratch;   // for deleting 'stream', as the scan holds 'path'
 	api_error_vec  errors;
+	api_error_vec  s_errors;  // of deleting 'stream', go to deleter_err
 };
 
 typedef vector<ultra_task *> ultra_task_vec;
@@ -71,6 +105,7 @@ struct ultra_task_pool
 	bool unused() const;
 
 	ultra_mach    * mach;
+	SRWLOCK         lock;
 	ultra_task_vec  cache;
 	size_t          allocated;
 };
@@ -80,33 +115,77 @@ struct ultra_mach
 {
 	ultra_mach_conf    conf;
 	ultra_mach_cb    * cb;
+	fs_api_native      native;
+	fs_api           * fs;
 	bool               ph1_only;  // aka 'just_scan'
-
-	simple_work_queue  swq;
+	bool               prescanned; // ph1 just visits folders
+	bool               streaming;  // ph1 deletes files, there's no ph2
+	bool               pipelined;  // ph1 hands off files to ph2 as it goes
+	bool               held;       // scanned folders are held until complete_ph1()
+
+	steal_queue        scanners;  // ph1
+	steal_queue        deleters;  // ph2, ph3
+	thread_tuner       scan_tuner;
+	thread_tuner       delete_tuner;
 	ultra_task_pool    pool;
-	bool               enough;
+	volatile bool      enough;
+
+	volatile size_t    pending;   // tasks in flight, +1 until loop()
+	HANDLE             finished;  // set when 'pending' hits 0
+
+	SRWLOCK            cursor_lock;
+	folder_vec         cursor;    // prescanned folders yet to visit
+	volatile size_t    deferred;  // cursor.size()
+
+	SRWLOCK            retry_lock;
+	ultra_task_vec     retry_q;   // waiting for their 'due' time
+
+	SRWLOCK            err_lock;
+	api_error_vec      scanner_err;
+	api_error_vec      deleter_err;
+
+	SRWLOCK            stats_lock;
+	ultra_stats_vec    stats;
 
 	ultra_mach_info    info;
-	size_t             ph1_work, ph2_work, ph3_work;
-	size_t             ph1_done, ph2_done, ph3_done;
+	volatile size_t    ph1_work, ph2_work, ph3_work;
+	volatile size_t    ph1_done, ph2_done, ph3_done;
+
+	volatile size_t    file_nsecs; // average time to delete a file
+	usec_t             tail_from;  // when the pool started running dry
+	usec_t             started;
 
 	//
 	ultra_mach();
 	~ultra_mach();
 
 	bool init(const ultra_mach_conf & conf, ultra_mach_cb * cb);
+	bool init_pool(steal_queue & q, thread_tuner & t, size_t threads, size_t levels);
 	void term();
 
-	bool keep_going() const;
-
+	void enqueue(ultra_task * w);
 	void enqueue_ph1(folder * x);
+	void enqueue_visit(folder * x);
+	void refill();
 	void enqueue_ph2(folder * x);
 	void enqueue_ph3(folder * x);
+	void enqueue_retry(ultra_task * w);
 
+	size_t ph2_batch(size_t total);
+	void on_ph2_timing(size_t files, uint64_t usecs);
+
+	// these run on the worker that executed the task
+	void complete(ultra_task * w);
 	void complete_ph1(ultra_task * w);
 	void complete_ph2(ultra_task * w);
 	void complete_ph3(ultra_task * w);
 
+	ultra_stats * get_stats(); // of the calling thread
+	void merge_stats();
+
+	void tick();
+	void tick_tail(usec_t now);
+	void tick_retries(usec_t now);
 	void loop();
 };
 
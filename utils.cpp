@@ -10,6 +10,8 @@
  */
 #include "utils.h"
 
+#include <wctype.h>
+
 #include "libp/string_utils.h"
 #include "libp/_system_api.h"
 
@@ -60,6 +62,28 @@ string format_usecs(uint64_t usecs)
 	return stringf("%02zu:%02zu:%02zu.%03zu", hr, min, sec, ms);
 }
 
+string format_latency(uint64_t usecs)
+{
+	if (usecs < 1000)
+		return stringf("%I64u us", usecs);
+
+	if (usecs < 1000*1000)
+		return stringf("%.1lf ms", usecs/1000.);
+
+	return stringf("%.2lf sec", usecs/1000./1000.);
+}
+
+//
+wstring to_lower(const wstring & str)
+{
+	wstring r = str;
+
+	for (auto & c : r)
+		c = towlower(c);
+
+	return r;
+}
+
 //
 template <class E>
 void replace(std::basic_string<E> & str, const E * a, const E * b)
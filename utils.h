@@ -23,6 +23,9 @@
 string format_count(uint64_t val, const char * unit);
 string format_bytes(uint64_t bytes);
 string format_usecs(uint64_t usecs);
+string format_latency(uint64_t usecs);
+
+wstring to_lower(const wstring & str);
 
 bool get_error_desc(dword code, wstring & mesg);
 string error_to_str(const api_error & e);